@@ -0,0 +1,575 @@
+#define pr_fmt(fmt) "myfs: " fmt
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/percpu_counter.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "myfs.h"
+
+/*
+ * In-memory index of the free runs of the block free bitmap. Every free run
+ * is linked in two rbtrees: one sorted by first block (used to merge a freed
+ * range with its neighbours) and one sorted by length then first block (used
+ * to find the smallest run large enough for an allocation). Both allocation
+ * and free are O(log n) in the number of free runs.
+ */
+
+static struct kmem_cache *myfs_free_extent_cache;
+
+int myfs_init_free_extent_cache(void)
+{
+    myfs_free_extent_cache =
+        kmem_cache_create("myfs_free_extent", sizeof(struct myfs_free_extent),
+                          0, 0, NULL);
+    if (!myfs_free_extent_cache)
+        return -ENOMEM;
+    return 0;
+}
+
+void myfs_destroy_free_extent_cache(void)
+{
+    kmem_cache_destroy(myfs_free_extent_cache);
+}
+
+static void fe_insert_start(struct myfs_free_index *fi,
+                            struct myfs_free_extent *fe)
+{
+    struct rb_node **p = &fi->by_start.rb_node, *parent = NULL;
+
+    while (*p) {
+        struct myfs_free_extent *cur =
+            rb_entry(*p, struct myfs_free_extent, rb_start);
+        parent = *p;
+        if (fe->fe_start < cur->fe_start)
+            p = &(*p)->rb_left;
+        else
+            p = &(*p)->rb_right;
+    }
+    rb_link_node(&fe->rb_start, parent, p);
+    rb_insert_color(&fe->rb_start, &fi->by_start);
+}
+
+static void fe_insert_len(struct myfs_free_index *fi,
+                          struct myfs_free_extent *fe)
+{
+    struct rb_node **p = &fi->by_len.rb_node, *parent = NULL;
+
+    while (*p) {
+        struct myfs_free_extent *cur =
+            rb_entry(*p, struct myfs_free_extent, rb_len);
+        parent = *p;
+        if (fe->fe_len < cur->fe_len ||
+            (fe->fe_len == cur->fe_len && fe->fe_start < cur->fe_start))
+            p = &(*p)->rb_left;
+        else
+            p = &(*p)->rb_right;
+    }
+    rb_link_node(&fe->rb_len, parent, p);
+    rb_insert_color(&fe->rb_len, &fi->by_len);
+}
+
+static void fe_erase(struct myfs_free_index *fi, struct myfs_free_extent *fe)
+{
+    rb_erase(&fe->rb_start, &fi->by_start);
+    rb_erase(&fe->rb_len, &fi->by_len);
+    kmem_cache_free(myfs_free_extent_cache, fe);
+}
+
+static struct myfs_free_extent *fe_new(uint32_t start, uint32_t len)
+{
+    struct myfs_free_extent *fe =
+        kmem_cache_alloc(myfs_free_extent_cache, GFP_NOFS);
+    if (!fe)
+        return NULL;
+    fe->fe_start = start;
+    fe->fe_len = len;
+    return fe;
+}
+
+/*
+ * Build the free extent index from bits [first, size) of freemap.
+ * Return 0 on success, -ENOMEM if a node could not be allocated.
+ */
+int myfs_free_index_build(struct myfs_free_index *fi,
+                          unsigned long *freemap,
+                          unsigned long first,
+                          unsigned long size)
+{
+    unsigned long start, end;
+
+    fi->by_start = RB_ROOT;
+    fi->by_len = RB_ROOT;
+
+    start = find_next_bit(freemap, size, first);
+    while (start < size) {
+        struct myfs_free_extent *fe;
+
+        end = find_next_zero_bit(freemap, size, start);
+        fe = fe_new(start, end - start);
+        if (!fe) {
+            myfs_free_index_destroy(fi);
+            return -ENOMEM;
+        }
+        fe_insert_start(fi, fe);
+        fe_insert_len(fi, fe);
+        start = find_next_bit(freemap, size, end);
+    }
+
+    return 0;
+}
+
+/* Release every node of the free extent index */
+void myfs_free_index_destroy(struct myfs_free_index *fi)
+{
+    struct myfs_free_extent *fe, *tmp;
+
+    rbtree_postorder_for_each_entry_safe(fe, tmp, &fi->by_start, rb_start)
+        kmem_cache_free(myfs_free_extent_cache, fe);
+    fi->by_start = RB_ROOT;
+    fi->by_len = RB_ROOT;
+}
+
+/*
+ * Take `len` consecutive free blocks from the smallest free run that can hold
+ * them. Return the first block of the range, or 0 if no run is large enough.
+ * The caller is responsible for updating the bitmap.
+ */
+uint32_t myfs_free_index_take(struct myfs_free_index *fi, uint32_t len)
+{
+    struct rb_node *n = fi->by_len.rb_node;
+    struct myfs_free_extent *best = NULL;
+    uint32_t ret;
+
+    while (n) {
+        struct myfs_free_extent *cur =
+            rb_entry(n, struct myfs_free_extent, rb_len);
+        if (cur->fe_len >= len) {
+            best = cur;
+            n = n->rb_left;
+        } else {
+            n = n->rb_right;
+        }
+    }
+    if (!best)
+        return 0;
+
+    ret = best->fe_start;
+    if (best->fe_len == len) {
+        fe_erase(fi, best);
+        return ret;
+    }
+
+    /* Shrink the run from its start: by_start order is unchanged */
+    rb_erase(&best->rb_len, &fi->by_len);
+    best->fe_start += len;
+    best->fe_len -= len;
+    fe_insert_len(fi, best);
+
+    return ret;
+}
+
+/*
+ * Carve [bno, bno + len) out of the free run fe, which must contain it. A
+ * range in the middle of the run splits it in two and consumes *spare.
+ */
+static void fe_carve(struct myfs_free_index *fi,
+                     struct myfs_free_extent *fe,
+                     uint32_t bno,
+                     uint32_t len,
+                     struct myfs_free_extent **spare)
+{
+    uint32_t end = fe->fe_start + fe->fe_len;
+
+    if (fe->fe_len == len) {
+        fe_erase(fi, fe);
+        return;
+    }
+
+    rb_erase(&fe->rb_len, &fi->by_len);
+    if (bno == fe->fe_start) {
+        fe->fe_start += len;
+        fe->fe_len -= len;
+    } else if (bno + len == end) {
+        fe->fe_len -= len;
+    } else {
+        struct myfs_free_extent *tail = *spare;
+
+        *spare = NULL;
+        fe->fe_len = bno - fe->fe_start;
+        tail->fe_start = bno + len;
+        tail->fe_len = end - tail->fe_start;
+        fe_insert_start(fi, tail);
+        fe_insert_len(fi, tail);
+    }
+    fe_insert_len(fi, fe);
+}
+
+/*
+ * Take `len` consecutive free blocks as close as possible to goal. If the
+ * run containing goal has room, the range starts exactly at goal (this needs
+ * *spare to split the run). Otherwise, up to MYFS_GOAL_SCAN runs are looked
+ * at on each side of goal and the closest one large enough is used: from its
+ * start when after goal, from its end when before goal.
+ * Return the first block of the range, or 0 if nothing was found near goal.
+ */
+uint32_t myfs_free_index_take_near(struct myfs_free_index *fi,
+                                   uint32_t goal,
+                                   uint32_t len,
+                                   struct myfs_free_extent **spare)
+{
+    struct rb_node *n = fi->by_start.rb_node, *pos;
+    struct myfs_free_extent *prev = NULL, *next = NULL, *fwd = NULL,
+                            *back = NULL;
+    uint32_t bno;
+    int i;
+
+    while (n) {
+        struct myfs_free_extent *cur =
+            rb_entry(n, struct myfs_free_extent, rb_start);
+        if (goal < cur->fe_start) {
+            next = cur;
+            n = n->rb_left;
+        } else {
+            prev = cur;
+            n = n->rb_right;
+        }
+    }
+
+    /* The run containing goal has room for the whole range */
+    if (prev && prev->fe_start + prev->fe_len >= goal + len &&
+        (goal == prev->fe_start || *spare ||
+         prev->fe_start + prev->fe_len == goal + len)) {
+        fe_carve(fi, prev, goal, len, spare);
+        return goal;
+    }
+
+    /* Search outward from goal */
+    for (pos = next ? &next->rb_start : NULL, i = 0; pos && i < MYFS_GOAL_SCAN;
+         pos = rb_next(pos), i++) {
+        struct myfs_free_extent *cur =
+            rb_entry(pos, struct myfs_free_extent, rb_start);
+        if (cur->fe_len >= len) {
+            fwd = cur;
+            break;
+        }
+    }
+    for (pos = prev ? &prev->rb_start : NULL, i = 0; pos && i < MYFS_GOAL_SCAN;
+         pos = rb_prev(pos), i++) {
+        struct myfs_free_extent *cur =
+            rb_entry(pos, struct myfs_free_extent, rb_start);
+        if (cur->fe_len >= len) {
+            back = cur;
+            break;
+        }
+    }
+
+    if (back) {
+        uint32_t dist;
+
+        bno = back->fe_start + back->fe_len - len;
+        dist = bno > goal ? bno - goal : goal - bno;
+        if (!fwd || dist < fwd->fe_start - goal) {
+            fe_carve(fi, back, bno, len, spare);
+            return bno;
+        }
+    }
+    if (fwd) {
+        bno = fwd->fe_start;
+        fe_carve(fi, fwd, bno, len, spare);
+        return bno;
+    }
+
+    return 0;
+}
+
+/*
+ * Give back `len` blocks starting at bno to the index, merging them with the
+ * adjacent free runs. A lone range consumes the node preallocated in *spare
+ * (set to NULL when used), which must not be NULL: freed blocks missing from
+ * the index could not be allocated again until the next mount.
+ */
+void myfs_free_index_put(struct myfs_free_index *fi,
+                         uint32_t bno,
+                         uint32_t len,
+                         struct myfs_free_extent **spare)
+{
+    struct rb_node *n = fi->by_start.rb_node;
+    struct myfs_free_extent *prev = NULL, *next = NULL, *fe;
+
+    while (n) {
+        struct myfs_free_extent *cur =
+            rb_entry(n, struct myfs_free_extent, rb_start);
+        if (bno < cur->fe_start) {
+            next = cur;
+            n = n->rb_left;
+        } else {
+            prev = cur;
+            n = n->rb_right;
+        }
+    }
+
+    if (prev && prev->fe_start + prev->fe_len == bno) {
+        rb_erase(&prev->rb_len, &fi->by_len);
+        prev->fe_len += len;
+        if (next && bno + len == next->fe_start) {
+            prev->fe_len += next->fe_len;
+            fe_erase(fi, next);
+        }
+        fe_insert_len(fi, prev);
+        return;
+    }
+
+    if (next && bno + len == next->fe_start) {
+        rb_erase(&next->rb_len, &fi->by_len);
+        next->fe_start = bno;
+        next->fe_len += len;
+        fe_insert_len(fi, next);
+        return;
+    }
+
+    fe = *spare;
+    *spare = NULL;
+    fe->fe_start = bno;
+    fe->fe_len = len;
+    fe_insert_start(fi, fe);
+    fe_insert_len(fi, fe);
+}
+
+/*
+ * Allocation groups. Each group covers the bits of one bitmap block (32768
+ * inodes or blocks) and has its own lock, free counter and dirty flag. Block
+ * groups also have their own free extent index. The global free counters are
+ * per-cpu, so that allocations in different groups do not contend on them.
+ */
+
+static int myfs_groups_setup(struct myfs_group *groups,
+                             uint32_t nr_groups,
+                             uint32_t per_group,
+                             unsigned long *freemap,
+                             uint32_t size,
+                             bool index)
+{
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < nr_groups; i++) {
+        struct myfs_group *g = &groups[i];
+
+        spin_lock_init(&g->lock);
+        g->first = i * per_group;
+        g->count = min(per_group, size - g->first);
+        g->nr_free = bitmap_weight(freemap + g->first / BITS_PER_LONG,
+                                   g->count);
+        g->dirty = false;
+        g->index.by_start = RB_ROOT;
+        g->index.by_len = RB_ROOT;
+        if (!index)
+            continue;
+        ret = myfs_free_index_build(&g->index, freemap, g->first,
+                                    g->first + g->count);
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+static uint64_t myfs_groups_free(struct myfs_group *groups, uint32_t nr_groups)
+{
+    uint64_t nr_free = 0;
+    uint32_t i;
+
+    for (i = 0; i < nr_groups; i++)
+        nr_free += groups[i].nr_free;
+    return nr_free;
+}
+
+/*
+ * Split the in-memory bitmaps of sbi in allocation groups and initialize the
+ * free counters. Return 0 on success, a negative error code otherwise.
+ */
+int myfs_groups_init(struct myfs_sb_info *sbi)
+{
+    int ret;
+
+    sbi->nr_igroups = DIV_ROUND_UP(sbi->nr_inodes, MYFS_INODES_PER_GROUP);
+    sbi->nr_bgroups = DIV_ROUND_UP(sbi->nr_blocks, MYFS_BLOCKS_PER_GROUP);
+
+    sbi->igroups =
+        kcalloc(sbi->nr_igroups, sizeof(struct myfs_group), GFP_KERNEL);
+    sbi->bgroups =
+        kcalloc(sbi->nr_bgroups, sizeof(struct myfs_group), GFP_KERNEL);
+    if (!sbi->igroups || !sbi->bgroups) {
+        ret = -ENOMEM;
+        goto free_groups;
+    }
+
+    ret = myfs_groups_setup(sbi->igroups, sbi->nr_igroups,
+                            MYFS_INODES_PER_GROUP, sbi->ifree_bitmap,
+                            sbi->nr_inodes, false);
+    if (ret)
+        goto free_groups;
+    ret = myfs_groups_setup(sbi->bgroups, sbi->nr_bgroups,
+                            MYFS_BLOCKS_PER_GROUP, sbi->bfree_bitmap,
+                            sbi->nr_blocks, true);
+    if (ret)
+        goto free_groups;
+
+    ret = percpu_counter_init(&sbi->free_inodes_counter,
+                              myfs_groups_free(sbi->igroups, sbi->nr_igroups),
+                              GFP_KERNEL);
+    if (ret)
+        goto free_groups;
+    ret = percpu_counter_init(&sbi->free_blocks_counter,
+                              myfs_groups_free(sbi->bgroups, sbi->nr_bgroups),
+                              GFP_KERNEL);
+    if (ret)
+        goto destroy_inodes_counter;
+    ret = percpu_counter_init(&sbi->dirty_blocks_counter, 0, GFP_KERNEL);
+    if (ret)
+        goto destroy_blocks_counter;
+
+    return 0;
+
+destroy_blocks_counter:
+    percpu_counter_destroy(&sbi->free_blocks_counter);
+destroy_inodes_counter:
+    percpu_counter_destroy(&sbi->free_inodes_counter);
+free_groups:
+    if (sbi->bgroups) {
+        uint32_t i;
+        for (i = 0; i < sbi->nr_bgroups; i++)
+            myfs_free_index_destroy(&sbi->bgroups[i].index);
+    }
+    kfree(sbi->bgroups);
+    kfree(sbi->igroups);
+    sbi->bgroups = sbi->igroups = NULL;
+    return ret;
+}
+
+/* Release what myfs_groups_init() allocated */
+void myfs_groups_destroy(struct myfs_sb_info *sbi)
+{
+    uint32_t i;
+
+    if (!sbi->bgroups)
+        return;
+
+    for (i = 0; i < sbi->nr_bgroups; i++)
+        myfs_free_index_destroy(&sbi->bgroups[i].index);
+    percpu_counter_destroy(&sbi->dirty_blocks_counter);
+    percpu_counter_destroy(&sbi->free_blocks_counter);
+    percpu_counter_destroy(&sbi->free_inodes_counter);
+    kfree(sbi->bgroups);
+    kfree(sbi->igroups);
+    sbi->bgroups = sbi->igroups = NULL;
+}
+
+/*
+ * Take a free inode from the group-th inode group. Return 0 if the group is
+ * full.
+ */
+uint32_t myfs_group_take_inode(struct myfs_sb_info *sbi, uint32_t group)
+{
+    struct myfs_group *g = &sbi->igroups[group];
+    unsigned long end = g->first + g->count;
+    unsigned long ino;
+
+    if (!READ_ONCE(g->nr_free))
+        return 0;
+
+    spin_lock(&g->lock);
+    ino = find_next_bit(sbi->ifree_bitmap, end, g->first);
+    if (ino < end) {
+        __clear_bit(ino, sbi->ifree_bitmap);
+        g->nr_free--;
+        g->dirty = true;
+    } else {
+        ino = 0;
+    }
+    spin_unlock(&g->lock);
+
+    if (ino)
+        percpu_counter_dec(&sbi->free_inodes_counter);
+    return ino;
+}
+
+/* Mark ino as free in its inode group */
+void myfs_group_put_inode(struct myfs_sb_info *sbi, uint32_t ino)
+{
+    struct myfs_group *g = &sbi->igroups[ino / MYFS_INODES_PER_GROUP];
+
+    spin_lock(&g->lock);
+    __set_bit(ino, sbi->ifree_bitmap);
+    g->nr_free++;
+    g->dirty = true;
+    spin_unlock(&g->lock);
+
+    percpu_counter_inc(&sbi->free_inodes_counter);
+}
+
+/*
+ * Take `len` consecutive free blocks from the group-th block group, as close
+ * as possible to goal if goal belongs to this group. Return the first block,
+ * or 0 if the group has no free run large enough.
+ */
+uint32_t myfs_group_take_blocks(struct myfs_sb_info *sbi,
+                                uint32_t group,
+                                uint32_t goal,
+                                uint32_t len)
+{
+    struct myfs_group *g = &sbi->bgroups[group];
+    struct myfs_free_extent *spare = NULL;
+    bool near = goal >= g->first && goal < g->first + g->count;
+    uint32_t bno = 0;
+
+    if (READ_ONCE(g->nr_free) < len)
+        return 0;
+
+    if (near)
+        spare = kmem_cache_alloc(myfs_free_extent_cache, GFP_NOFS);
+
+    spin_lock(&g->lock);
+    if (near)
+        bno = myfs_free_index_take_near(&g->index, goal, len, &spare);
+    if (!bno)
+        bno = myfs_free_index_take(&g->index, len);
+    if (bno) {
+        bitmap_clear(sbi->bfree_bitmap, bno, len);
+        g->nr_free -= len;
+        g->dirty = true;
+    }
+    spin_unlock(&g->lock);
+
+    if (spare)
+        kmem_cache_free(myfs_free_extent_cache, spare);
+    if (bno)
+        percpu_counter_sub(&sbi->free_blocks_counter, len);
+    return bno;
+}
+
+/*
+ * Give back `len` blocks starting at bno to their block group. The range must
+ * not cross a group boundary. Freeing cannot fail, so neither can allocating
+ * the node which may be needed to index the range.
+ */
+void myfs_group_put_blocks(struct myfs_sb_info *sbi, uint32_t bno, uint32_t len)
+{
+    struct myfs_group *g = &sbi->bgroups[bno / MYFS_BLOCKS_PER_GROUP];
+    struct myfs_free_extent *spare =
+        kmem_cache_alloc(myfs_free_extent_cache, GFP_NOFS | __GFP_NOFAIL);
+
+    spin_lock(&g->lock);
+    bitmap_set(sbi->bfree_bitmap, bno, len);
+    g->nr_free += len;
+    g->dirty = true;
+    myfs_free_index_put(&g->index, bno, len, &spare);
+    spin_unlock(&g->lock);
+
+    if (spare)
+        kmem_cache_free(myfs_free_extent_cache, spare);
+    percpu_counter_add(&sbi->free_blocks_counter, len);
+}
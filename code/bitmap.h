@@ -2,91 +2,103 @@
 #define MYFS_BITMAP_H
 
 #include <linux/bitmap.h>
+#include <linux/smp.h>
 #include "myfs.h"
 
 /*
- * Return the first bit we found and clear the the following `len` consecutive
- * free bit(s) (set to 1) in a given in-memory bitmap spanning over multiple
- * blocks. Return 0 if no enough free bit(s) were found (we assume that the
- * first bit is never free because of the superblock and the root inode, thus
- * allowing us to use 0 as an error value).
+ * The inode and block bitmaps are split in allocation groups, each protected
+ * by its own lock (see balloc.c). The helpers below pick the group to start
+ * from and spill to the next groups when it is full. We assume that the first
+ * inode and block are never free because of the root inode and the
+ * superblock, thus allowing us to use 0 as an error value.
  */
-static inline uint32_t get_first_free_bits(unsigned long *freemap,
-                                           unsigned long size,
-                                           uint32_t len)
+
+/* Group to start from for an allocation on the current CPU */
+static inline uint32_t myfs_cpu_group(uint32_t nr_groups)
 {
-    uint32_t bit, prev = 0, count = 0;
-    for_each_set_bit (bit, freemap, size) {
-        if (prev != bit - 1)
-            count = 0;
-        prev = bit;
-        if (++count == len) {
-            bitmap_clear(freemap, bit - len + 1, len);
-            return bit - len + 1;
-        }
-    }
-    return 0;
+    return raw_smp_processor_id() % nr_groups;
 }
 
 /*
- * Return an unused inode number and mark it used.
+ * Return an unused inode number and mark it used. New directories are spread
+ * over the inode groups by CPU, other inodes start from the group of their
+ * parent directory.
  * Return 0 if no free inode was found.
  */
-static inline uint32_t get_free_inode(struct myfs_sb_info *sbi)
+static inline uint32_t get_free_inode(struct myfs_sb_info *sbi,
+                                      struct inode *dir,
+                                      umode_t mode)
 {
-    uint32_t ret = get_first_free_bits(sbi->ifree_bitmap, sbi->nr_inodes, 1);
-    if (ret)
-        sbi->nr_free_inodes--;
-    return ret;
+    uint32_t start, i, ret;
+
+    if (S_ISDIR(mode))
+        start = myfs_cpu_group(sbi->nr_igroups);
+    else
+        start = dir->i_ino / MYFS_INODES_PER_GROUP;
+
+    for (i = 0; i < sbi->nr_igroups; i++) {
+        ret = myfs_group_take_inode(sbi, (start + i) % sbi->nr_igroups);
+        if (ret)
+            return ret;
+    }
+    return 0;
 }
 
 /*
- * Return `len` unused block(s) number and mark it used.
+ * Return `len` unused block(s) number and mark it used. If goal is not 0, the
+ * blocks are searched outward from goal in its block group first. Otherwise,
+ * the run is taken from the block group of the current CPU. Full groups spill
+ * to the next ones.
  * Return 0 if no enough free block(s) were found.
  */
 static inline uint32_t get_free_blocks(struct myfs_sb_info *sbi,
+                                       uint32_t goal,
                                        uint32_t len)
 {
-    uint32_t ret = get_first_free_bits(sbi->bfree_bitmap, sbi->nr_blocks, len);
-    if (ret)
-        sbi->nr_free_blocks -= len;
-    return ret;
-}
-
-
-/* Mark the `len` bit(s) from i-th bit in freemap as free (i.e. 1) */
-static inline int put_free_bits(unsigned long *freemap,
-                                unsigned long size,
-                                uint32_t i,
-                                uint32_t len)
-{
-    /* i is greater than freemap size */
-    if (i + len - 1 > size)
-        return -1;
+    uint32_t start, i, ret;
 
-    bitmap_set(freemap, i, len);
+    if (goal && goal < sbi->nr_blocks)
+        start = goal / MYFS_BLOCKS_PER_GROUP;
+    else
+        start = myfs_cpu_group(sbi->nr_bgroups);
 
+    for (i = 0; i < sbi->nr_bgroups; i++) {
+        ret = myfs_group_take_blocks(sbi, (start + i) % sbi->nr_bgroups, goal,
+                                     len);
+        if (ret)
+            return ret;
+    }
     return 0;
 }
 
 /* Mark an inode as unused */
 static inline void put_inode(struct myfs_sb_info *sbi, uint32_t ino)
 {
-    if (put_free_bits(sbi->ifree_bitmap, sbi->nr_inodes, ino, 1))
+    /* ino is greater than the number of inodes */
+    if (ino >= sbi->nr_inodes)
         return;
 
-    sbi->nr_free_inodes++;
+    myfs_group_put_inode(sbi, ino);
 }
 
-/* Mark len block(s) as unused */
+/* Mark len block(s) as unused, splitting the range at group boundaries */
 static inline void put_blocks(struct myfs_sb_info *sbi,
                               uint32_t bno,
                               uint32_t len)
 {
-    if (put_free_bits(sbi->bfree_bitmap, sbi->nr_blocks, bno, len))
+    /* bno is greater than the number of blocks */
+    if (bno + len > sbi->nr_blocks)
         return;
 
-    sbi->nr_free_blocks += len;
+    while (len) {
+        uint32_t end = (bno / MYFS_BLOCKS_PER_GROUP + 1) *
+                       MYFS_BLOCKS_PER_GROUP;
+        uint32_t n = min(len, end - bno);
+
+        myfs_group_put_blocks(sbi, bno, n);
+        bno += n;
+        len -= n;
+    }
 }
 
 #endif /* MYFS_BITMAP_H */
@@ -4,59 +4,1595 @@
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/rculist.h>
+#include <linux/siphash.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 
+#include "bitmap.h"
 #include "myfs.h"
 
+/*
+ * A directory is a sequence of blocks mapped by its extent tree. While it fits
+ * in one block, its entries are looked up linearly in block 0. When block 0 is
+ * full, the directory gets a hash index (see struct myfs_dx_node): block 0
+ * becomes the index root and the entries are spread over blocks by name hash,
+ * each block covering a range of hashes. Full blocks are split in two at their
+ * median hash. A lookup or an insertion thus reads the root, at most one index
+ * node and one block of entries, whatever the size of the directory. Removed
+ * entries leave tombstones, which a removal compacts once a block holds too
+ * many. A block left without entries is dropped from the index and freed, and
+ * the next block added to the directory fills its hole.
+ *
+ * Records move when a block is compacted or split, so readdir positions are
+ * not offsets in the directory but name hashes: entries are returned in hash
+ * order, and an entry is neither missed nor returned twice because of
+ * changes to other entries.
+ *
+ * Locking: the blocks, the index and the lookup cache of a directory are
+ * protected by its i_dir_sem. Changes (create, link, unlink, rename, rmdir)
+ * and building the lookup cache hold it for writing, readdir and lookups that
+ * read blocks hold it for reading. Lookups answered by the lookup cache take
+ * no lock: they read it under RCU and retry if i_dir_seqlock tells them a
+ * change went by. The VFS i_rwsem is taken outside of i_dir_sem, and still
+ * makes renames atomic. The mapping of the blocks is protected by i_map_sem,
+ * like for files, and block allocation by the allocation group locks (see
+ * balloc.c). Nothing is shared between directories, so changes to different
+ * directories only meet in the allocator.
+ */
+
+/*
+ * 64-bit hash of a name in dir. Its high 32 bits are stored in the index.
+ * mkfs stores a random key in the superblock, and names are hashed with
+ * SipHash under that key, so that names colliding on purpose cannot be
+ * crafted to fill a block with a single hash, which could not be split.
+ */
+static uint64_t myfs_name_hash(struct inode *dir,
+                               const char *name,
+                               unsigned int len)
+{
+    struct myfs_sb_info *sbi = MYFS_SB(dir->i_sb);
+    const uint32_t *seed = sbi->hash_seed;
+    siphash_key_t key = {{
+        (uint64_t) le32_to_cpu(seed[1]) << 32 | le32_to_cpu(seed[0]),
+        (uint64_t) le32_to_cpu(seed[3]) << 32 | le32_to_cpu(seed[2]),
+    }};
+
+    return siphash(name, len, &key);
+}
+
+/* Hash of a name stored in the index */
+static inline uint32_t myfs_dirhash(struct inode *dir,
+                                    const char *name,
+                                    unsigned int len)
+{
+    return myfs_name_hash(dir, name, len) >> 32;
+}
+
+static inline uint32_t myfs_entry_hash(struct inode *dir,
+                                       const struct myfs_dir_entry *de)
+{
+    return myfs_dirhash(dir, de->name, de->name_len);
+}
+
+/* Make data an empty directory block: a single unused record */
+static inline void myfs_block_init(char *data)
+{
+    struct myfs_dir_entry *de = (struct myfs_dir_entry *) data;
+
+    memset(data, 0, MYFS_BLOCK_SIZE);
+    de->rec_len = MYFS_BLOCK_SIZE;
+}
+
+/*
+ * Return the record at offset off of the block data of dir, or NULL if it
+ * does not fit in the block.
+ */
+static struct myfs_dir_entry *myfs_block_entry(struct inode *dir,
+                                               char *data,
+                                               unsigned int off)
+{
+    struct myfs_dir_entry *de = (struct myfs_dir_entry *) (data + off);
+
+    if (de->rec_len < MYFS_DIR_REC_LEN(0) || de->rec_len % 4 ||
+        de->rec_len > MYFS_BLOCK_SIZE - off ||
+        (de->inode && de->rec_len < MYFS_DIR_REC_LEN(de->name_len))) {
+        pr_err("corrupted entry in directory %lu\n", dir->i_ino);
+        return NULL;
+    }
+    return de;
+}
+
+/* Number of blocks of dir */
+static inline uint32_t myfs_dir_blocks(struct inode *dir)
+{
+    return i_size_read(dir) / MYFS_BLOCK_SIZE;
+}
+
+/*
+ * Read logical block `block` of dir. Return NULL if it is a hole, left by a
+ * block freed once empty.
+ */
+static struct buffer_head *myfs_dir_bread_hole(struct inode *dir,
+                                               uint32_t block)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(dir);
+    struct myfs_extent *ext;
+    struct buffer_head *bh;
+    uint32_t bno = 0;
+    int ret;
+
+    ret = myfs_ext_cache_read_lock(dir);
+    if (ret)
+        return ERR_PTR(ret);
+    ext = myfs_ext_cache_lookup(dir, block);
+    if (ext)
+        bno = ext->ee_start + block - ext->ee_block;
+    up_read(&ci->i_map_sem);
+
+    if (!bno)
+        return NULL;
+
+    bh = sb_bread(dir->i_sb, bno);
+    if (!bh)
+        return ERR_PTR(-EIO);
+    return bh;
+}
+
+/* Read logical block `block` of dir, which must not be a hole */
+static struct buffer_head *myfs_dir_bread(struct inode *dir, uint32_t block)
+{
+    struct buffer_head *bh = myfs_dir_bread_hole(dir, block);
+
+    if (!bh) {
+        pr_err("directory %lu has no block %u\n", dir->i_ino, block);
+        return ERR_PTR(-EIO);
+    }
+    return bh;
+}
+
+/*
+ * Add an empty block to dir, in the first hole left by a freed block or else
+ * at its end. Return its buffer and store its logical block number in block.
+ */
+static struct buffer_head *myfs_dir_append(struct inode *dir, uint32_t *block)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(dir);
+    struct myfs_sb_info *sbi = MYFS_SB(dir->i_sb);
+    struct myfs_extent ext;
+    struct buffer_head *bh;
+    uint32_t goal, bno, i;
+    int ret;
+
+    ret = myfs_ext_cache_write_lock(dir);
+    if (ret)
+        return ERR_PTR(ret);
+    *block = 0;
+    goal = ci->dir_block + 1;
+    for (i = 0; i < ci->i_nr_extents; i++) {
+        ext = ci->i_extents[i];
+        if (ext.ee_block > *block)
+            break;
+        *block = ext.ee_block + ext.ee_len;
+        goal = ext.ee_start + ext.ee_len;
+    }
+
+    bno = get_free_blocks(sbi, goal, 1);
+    if (!bno) {
+        ret = -ENOSPC;
+        goto unlock;
+    }
+
+    ext.ee_block = *block;
+    ext.ee_len = 1;
+    ext.ee_flags = 0;
+    ext.ee_start = bno;
+    ret = myfs_ext_insert(dir, &ext);
+    if (ret)
+        put_blocks(sbi, bno, 1);
+unlock:
+    up_write(&ci->i_map_sem);
+    if (ret < 0)
+        return ERR_PTR(ret);
+
+    bh = sb_getblk(dir->i_sb, bno);
+    if (!bh)
+        return ERR_PTR(-EIO);
+    lock_buffer(bh);
+    myfs_block_init(bh->b_data);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+
+    if (*block >= myfs_dir_blocks(dir))
+        i_size_write(dir, (loff_t) (*block + 1) * MYFS_BLOCK_SIZE);
+    dir->i_blocks++;
+    mark_inode_dirty(dir);
+
+    return bh;
+}
+
+/*
+ * Free block `block` of dir, bh, which holds no entry or was just added for
+ * nothing. It becomes a hole, and i_size shrinks if it was the last block.
+ */
+static void myfs_dir_free_block(struct inode *dir,
+                                struct buffer_head *bh,
+                                uint32_t block)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(dir);
+    struct myfs_extent *last;
+    int ret;
+
+    /* Drop the buffer so that it is never written to the freed block */
+    bforget(bh);
+
+    ret = myfs_ext_cache_write_lock(dir);
+    if (ret)
+        goto failed;
+    ret = myfs_ext_remove_blocks(dir, block, 1);
+    if (!ret) {
+        last = ci->i_nr_extents ? &ci->i_extents[ci->i_nr_extents - 1] : NULL;
+        i_size_write(dir, last ? (loff_t) (last->ee_block + last->ee_len) *
+                                     MYFS_BLOCK_SIZE
+                               : 0);
+        dir->i_blocks--;
+        mark_inode_dirty(dir);
+    }
+    up_write(&ci->i_map_sem);
+    if (!ret)
+        return;
+
+failed:
+    pr_err("failed freeing block %u of directory %lu, we just lost it\n",
+           block, dir->i_ino);
+}
+
+/* Return the record of block data of dir named name, NULL or ERR_PTR */
+static struct myfs_dir_entry *myfs_block_find(struct inode *dir,
+                                              char *data,
+                                              const struct qstr *name)
+{
+    struct myfs_dir_entry *de;
+    unsigned int off;
+
+    for (off = 0; off < MYFS_BLOCK_SIZE; off += de->rec_len) {
+        de = myfs_block_entry(dir, data, off);
+        if (!de)
+            return ERR_PTR(-EIO);
+        if (de->inode && de->name_len == name->len &&
+            !memcmp(de->name, name->name, name->len))
+            return de;
+    }
+    return NULL;
+}
+
+/* Append a copy of record de to the packed block data, used up to *end */
+static void myfs_block_pack(char *data,
+                            unsigned int *end,
+                            const struct myfs_dir_entry *de)
+{
+    struct myfs_dir_entry *new = (struct myfs_dir_entry *) (data + *end);
+    unsigned int len = MYFS_DIR_REC_LEN(de->name_len);
+
+    memcpy(new, de, sizeof(*de) + de->name_len);
+    new->rec_len = len;
+    *end += len;
+}
+
+/* Extend the last record packed in data, used up to end, to the block end */
+static void myfs_block_seal(char *data, unsigned int last, unsigned int end)
+{
+    if (!end)
+        myfs_block_init(data);
+    else
+        ((struct myfs_dir_entry *) (data + last))->rec_len +=
+            MYFS_BLOCK_SIZE - end;
+}
+
+/* Repack the live records of block data of dir, dropping tombstones */
+static int myfs_block_compact(struct inode *dir, char *data)
+{
+    struct myfs_dir_entry *de;
+    char *tmp;
+    unsigned int off, end = 0, last = 0;
+
+    tmp = kmalloc(MYFS_BLOCK_SIZE, GFP_NOFS);
+    if (!tmp)
+        return -ENOMEM;
+
+    for (off = 0; off < MYFS_BLOCK_SIZE; off += de->rec_len) {
+        de = myfs_block_entry(dir, data, off);
+        if (!de) {
+            kfree(tmp);
+            return -EIO;
+        }
+        if (!de->inode)
+            continue;
+        last = end;
+        myfs_block_pack(tmp, &end, de);
+    }
+    myfs_block_seal(tmp, last, end);
+    memcpy(data, tmp, MYFS_BLOCK_SIZE);
+
+    kfree(tmp);
+    return 0;
+}
+
+/*
+ * Add an entry for inode to block data of dir, in the first tombstone or
+ * unused end of a record big enough. If the free space of the block is large
+ * enough but scattered, the block is compacted first. Return -ENOSPC if the
+ * entry does not fit.
+ */
+static int myfs_block_add(struct inode *dir,
+                          char *data,
+                          const struct qstr *name,
+                          struct inode *inode)
+{
+    struct myfs_dir_entry *de;
+    unsigned int off, used, free = 0, len = MYFS_DIR_REC_LEN(name->len);
+    int ret;
+
+    for (off = 0; off < MYFS_BLOCK_SIZE; off += de->rec_len) {
+        de = myfs_block_entry(dir, data, off);
+        if (!de)
+            return -EIO;
+        used = de->inode ? MYFS_DIR_REC_LEN(de->name_len) : 0;
+        if (de->rec_len - used >= len)
+            goto found;
+        free += de->rec_len - used;
+    }
+
+    if (free < len)
+        return -ENOSPC;
+    ret = myfs_block_compact(dir, data);
+    if (ret)
+        return ret;
+    return myfs_block_add(dir, data, name, inode);
+
+found:
+    if (used) {
+        struct myfs_dir_entry *new =
+            (struct myfs_dir_entry *) (data + off + used);
+
+        new->rec_len = de->rec_len - used;
+        de->rec_len = used;
+        de = new;
+    }
+
+    de->inode = inode->i_ino;
+    de->name_len = name->len;
+    de->file_type = fs_umode_to_ftype(inode->i_mode);
+    memcpy(de->name, name->name, name->len);
+    return 0;
+}
+
+/*
+ * Remove record de from block data of dir by turning it into a tombstone,
+ * merged with the next record if that one is a tombstone too.
+ */
+static int myfs_block_remove(struct inode *dir,
+                             char *data,
+                             struct myfs_dir_entry *de)
+{
+    unsigned int off = (char *) de - data + de->rec_len;
+    struct myfs_dir_entry *next = NULL;
+
+    if (off < MYFS_BLOCK_SIZE) {
+        next = myfs_block_entry(dir, data, off);
+        if (!next)
+            return -EIO;
+    }
+
+    de->inode = 0;
+    memset(de->name, 0, de->name_len);
+    de->name_len = 0;
+    de->file_type = 0;
+    if (next && !next->inode) {
+        de->rec_len += next->rec_len;
+        memset(next, 0, sizeof(*next));
+    }
+    return 0;
+}
+
+/*
+ * A block is compacted when a removal leaves more tombstones than this in it,
+ * rather than waiting for an insertion to need its scattered free space.
+ */
+#define MYFS_BLOCK_MAX_TOMBSTONES 8
+
+/*
+ * Count the live records of block data of dir in live and its tombstones in
+ * dead. Return 0 or -EIO.
+ */
+static int myfs_block_usage(struct inode *dir,
+                            char *data,
+                            unsigned int *live,
+                            unsigned int *dead)
+{
+    struct myfs_dir_entry *de;
+    unsigned int off;
+
+    *live = *dead = 0;
+    for (off = 0; off < MYFS_BLOCK_SIZE; off += de->rec_len) {
+        de = myfs_block_entry(dir, data, off);
+        if (!de)
+            return -EIO;
+        if (de->inode)
+            (*live)++;
+        else
+            (*dead)++;
+    }
+    return 0;
+}
+
+static int myfs_hash_cmp(const void *a, const void *b)
+{
+    uint32_t ha = *(const uint32_t *) a, hb = *(const uint32_t *) b;
+
+    return ha < hb ? -1 : ha > hb;
+}
+
+/* Most records in a block, with 1-byte names */
+#define MYFS_BLOCK_MAX_ENTRIES (MYFS_BLOCK_SIZE / MYFS_DIR_REC_LEN(1))
+
+/*
+ * Move the entries of the full block data of dir with the highest hashes to
+ * the empty block new, and store the lowest hash moved in split. Entries with
+ * the same hash stay together. Return -ENOSPC if all entries have the same
+ * hash.
+ */
+static int myfs_block_split(struct inode *dir,
+                            char *data,
+                            char *new,
+                            uint32_t *split)
+{
+    struct myfs_dir_entry *de;
+    uint32_t *hashes;
+    char *tmp;
+    unsigned int off, end = 0, new_end = 0, last = 0, new_last = 0;
+    int i, n = 0, ret = 0;
+
+    hashes = kmalloc_array(MYFS_BLOCK_MAX_ENTRIES, sizeof(*hashes), GFP_NOFS);
+    tmp = kmalloc(MYFS_BLOCK_SIZE, GFP_NOFS);
+    if (!hashes || !tmp) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (off = 0; off < MYFS_BLOCK_SIZE; off += de->rec_len) {
+        de = myfs_block_entry(dir, data, off);
+        if (!de) {
+            ret = -EIO;
+            goto out;
+        }
+        if (de->inode)
+            hashes[n++] = myfs_entry_hash(dir, de);
+    }
+    sort(hashes, n, sizeof(*hashes), myfs_hash_cmp, NULL);
+
+    /* Split at the median, or above it so that both halves are not empty */
+    for (i = n / 2; i < n; i++) {
+        if (hashes[i] != hashes[0])
+            break;
+    }
+    if (i >= n) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    *split = hashes[i];
+
+    for (off = 0; off < MYFS_BLOCK_SIZE; off += de->rec_len) {
+        de = (struct myfs_dir_entry *) (data + off);
+        if (!de->inode)
+            continue;
+        if (myfs_entry_hash(dir, de) >= *split) {
+            new_last = new_end;
+            myfs_block_pack(new, &new_end, de);
+        } else {
+            last = end;
+            myfs_block_pack(tmp, &end, de);
+        }
+    }
+    myfs_block_seal(new, new_last, new_end);
+    myfs_block_seal(tmp, last, end);
+    memcpy(data, tmp, MYFS_BLOCK_SIZE);
+
+out:
+    kfree(tmp);
+    kfree(hashes);
+    return ret;
+}
+
+/*
+ * Split the full block bh of dir with a new block appended to dir, and store
+ * its number in block and the lowest hash moved to it in split. A copy of bh
+ * is split first, so that nothing is appended if the split is not possible.
+ */
+static int myfs_dir_split(struct inode *dir,
+                          struct buffer_head *bh,
+                          uint32_t *block,
+                          uint32_t *split)
+{
+    struct buffer_head *new;
+    char *low, *high;
+    int ret;
+
+    low = kmalloc(MYFS_BLOCK_SIZE, GFP_NOFS);
+    high = kzalloc(MYFS_BLOCK_SIZE, GFP_NOFS);
+    if (!low || !high) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    memcpy(low, bh->b_data, MYFS_BLOCK_SIZE);
+    ret = myfs_block_split(dir, low, high, split);
+    if (ret)
+        goto out;
+
+    new = myfs_dir_append(dir, block);
+    if (IS_ERR(new)) {
+        ret = PTR_ERR(new);
+        goto out;
+    }
+    memcpy(bh->b_data, low, MYFS_BLOCK_SIZE);
+    memcpy(new->b_data, high, MYFS_BLOCK_SIZE);
+    mark_buffer_dirty(bh);
+    mark_buffer_dirty(new);
+    brelse(new);
+
+out:
+    kfree(high);
+    kfree(low);
+    return ret;
+}
+
+/* Return the position of the entry of an index node covering hash */
+static int myfs_dx_search(struct myfs_dx_node *node, uint32_t hash)
+{
+    int lo = 1, hi = node->count - 1;
+
+    /* The first entry covers everything below the second one */
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (node->entries[mid].hash <= hash)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return lo - 1;
+}
+
+/* Insert an entry after position pos of node, which is not full */
+static void myfs_dx_insert(struct myfs_dx_node *node,
+                           int pos,
+                           uint32_t hash,
+                           uint32_t block)
+{
+    struct myfs_dx_entry *e = &node->entries[pos + 1];
+
+    memmove(e + 1, e, (node->count - pos - 1) * sizeof(*e));
+    e->hash = hash;
+    e->block = block;
+    node->count++;
+}
+
+/* Index nodes on the way from the root to a block of entries */
+struct myfs_dx_frame {
+    struct buffer_head *bh;
+    struct myfs_dx_node *node;
+    int pos; /* entry followed in node */
+};
+
+static void myfs_dx_release(struct myfs_dx_frame *frames, int nr)
+{
+    while (nr--)
+        brelse(frames[nr].bh);
+}
+
+/*
+ * Remove the entry followed in the last of the nr frames, whose block holds
+ * no entry anymore. Its hashes go to the block before it, or to the block
+ * after it for the first entry of a node. Return false if it is the only
+ * entry of its node, which keeps it.
+ */
+static bool myfs_dx_unlink(struct myfs_dx_frame *frames, int nr)
+{
+    struct myfs_dx_frame *frame = &frames[nr - 1];
+    struct myfs_dx_node *node = frame->node;
+    int pos = frame->pos;
+
+    if (node->count < 2)
+        return false;
+    if (!pos) {
+        /* The first entry covers everything below the second one */
+        node->entries[0].block = node->entries[1].block;
+        pos = 1;
+    }
+    memmove(&node->entries[pos], &node->entries[pos + 1],
+            (node->count - pos - 1) * sizeof(*node->entries));
+    node->count--;
+    memset(&node->entries[node->count], 0, sizeof(*node->entries));
+    mark_buffer_dirty(frame->bh);
+    return true;
+}
+
+/*
+ * Walk the index of dir down to the block of entries covering hash, stored in
+ * block. Fill frames with the index nodes on the way, the root first, and
+ * return their number, or a negative error.
+ */
+static int myfs_dx_probe(struct inode *dir,
+                         uint32_t hash,
+                         struct myfs_dx_frame *frames,
+                         uint32_t *block)
+{
+    struct myfs_dx_node *node;
+    uint32_t nblocks = myfs_dir_blocks(dir);
+    int depth = 0, nr = 0, ret = -EIO;
+
+    *block = 0;
+    do {
+        struct buffer_head *bh = myfs_dir_bread(dir, *block);
+
+        if (IS_ERR(bh)) {
+            ret = PTR_ERR(bh);
+            goto fail;
+        }
+        node = (struct myfs_dx_node *) bh->b_data;
+        frames[nr].bh = bh;
+        frames[nr].node = node;
+        nr++;
+
+        if (nr == 1)
+            depth = node->depth;
+        if (depth > MYFS_DX_MAX_DEPTH || !node->count ||
+            node->count > MYFS_DX_MAX) {
+            pr_err("corrupted index in directory %lu\n", dir->i_ino);
+            ret = -EIO;
+            goto fail;
+        }
+
+        frames[nr - 1].pos = myfs_dx_search(node, hash);
+        *block = node->entries[frames[nr - 1].pos].block;
+        if (!*block || *block >= nblocks) {
+            pr_err("corrupted index in directory %lu\n", dir->i_ino);
+            ret = -EIO;
+            goto fail;
+        }
+    } while (nr <= depth);
+
+    return nr;
+
+fail:
+    myfs_dx_release(frames, nr);
+    return ret;
+}
+
+/*
+ * Return the buffer of the block of dir which may hold name, or NULL if dir
+ * has no blocks.
+ */
+static struct buffer_head *myfs_dir_find_block(struct inode *dir,
+                                               const struct qstr *name)
+{
+    struct myfs_dx_frame frames[MYFS_DX_MAX_DEPTH + 1];
+    uint32_t block = 0;
+    int nr;
+
+    if (!myfs_dir_blocks(dir))
+        return NULL;
+
+    if (MYFS_INODE(dir)->i_flags & MYFS_INODE_INDEX) {
+        nr = myfs_dx_probe(dir, myfs_dirhash(dir, name->name, name->len),
+                           frames, &block);
+        if (nr < 0)
+            return ERR_PTR(nr);
+        myfs_dx_release(frames, nr);
+    }
+
+    return myfs_dir_bread(dir, block);
+}
+
+/*
+ * Turn the full block 0 of dir into the root of a hash index, moving its
+ * entries to two new blocks. On failure, dir is left as it was.
+ */
+static int myfs_dx_create(struct inode *dir, struct buffer_head *bh)
+{
+    struct buffer_head *bh1;
+    struct myfs_dx_node *root;
+    uint32_t block1, block2, split;
+    int ret;
+
+    bh1 = myfs_dir_append(dir, &block1);
+    if (IS_ERR(bh1))
+        return PTR_ERR(bh1);
+    memcpy(bh1->b_data, bh->b_data, MYFS_BLOCK_SIZE);
+    ret = myfs_dir_split(dir, bh1, &block2, &split);
+    if (ret) {
+        myfs_dir_free_block(dir, bh1, block1);
+        return ret;
+    }
+
+    root = (struct myfs_dx_node *) bh->b_data;
+    myfs_block_init(bh->b_data);
+    root->count = 2;
+    root->entries[0].block = block1;
+    root->entries[1].hash = split;
+    root->entries[1].block = block2;
+
+    MYFS_INODE(dir)->i_flags |= MYFS_INODE_INDEX;
+    mark_inode_dirty(dir);
+
+    mark_buffer_dirty(bh);
+    mark_buffer_dirty(bh1);
+    brelse(bh1);
+    return 0;
+}
+
+/*
+ * Make room for an insertion in the full block bh, reached through nr index
+ * frames. Split it, or if its index node is full, grow the index or split the
+ * node first. The caller then retries the insertion. Nothing is appended to
+ * dir if there is no room left in the index.
+ */
+static int myfs_dx_make_room(struct inode *dir,
+                             struct myfs_dx_frame *frames,
+                             int nr,
+                             struct buffer_head *bh)
+{
+    struct myfs_dx_frame *frame = &frames[nr - 1];
+    struct myfs_dx_node *node;
+    struct buffer_head *new;
+    uint32_t block, split;
+    int ret, half;
+
+    if (frame->node->count < MYFS_DX_MAX) {
+        ret = myfs_dir_split(dir, bh, &block, &split);
+        if (!ret) {
+            myfs_dx_insert(frame->node, frame->pos, split, block);
+            mark_buffer_dirty(frame->bh);
+        }
+        return ret;
+    }
+
+    /* Both levels of the index are full */
+    if (nr > 1 && frames[0].node->count >= MYFS_DX_MAX)
+        return -ENOSPC;
+
+    new = myfs_dir_append(dir, &block);
+    if (IS_ERR(new))
+        return PTR_ERR(new);
+    node = (struct myfs_dx_node *) new->b_data;
+
+    if (nr == 1) {
+        /* The root is full: move its entries to a new index node */
+        node->count = frame->node->count;
+        memcpy(node->entries, frame->node->entries,
+               node->count * sizeof(*node->entries));
+        memset(frame->node->entries, 0,
+               MYFS_DX_MAX * sizeof(*node->entries));
+        frame->node->count = 1;
+        frame->node->depth = 1;
+        frame->node->entries[0].block = block;
+    } else {
+        /* Move the upper half of the full index node to a new one */
+        half = frame->node->count / 2;
+        node->count = frame->node->count - half;
+        memcpy(node->entries, &frame->node->entries[half],
+               node->count * sizeof(*node->entries));
+        memset(&frame->node->entries[half], 0,
+               node->count * sizeof(*node->entries));
+        frame->node->count = half;
+        myfs_dx_insert(frames[0].node, frames[0].pos, node->entries[0].hash,
+                       block);
+        mark_buffer_dirty(frames[0].bh);
+    }
+
+    mark_buffer_dirty(frame->bh);
+    mark_buffer_dirty(new);
+    brelse(new);
+    return 0;
+}
+
+/*
+ * Lookup cache: a hash table of all the names of a directory, built on the
+ * first lookup. Once built, lookups, positive or negative, are answered
+ * without reading the directory and without taking any lock: they walk the
+ * table under RCU and the seqlock of the directory, and retry if a change
+ * went by. Changes to the directory hold its lock for writing and update the
+ * cache along with the blocks, under the seqlock. Directories of more than
+ * MYFS_DIR_CACHE_MAX_BLOCKS blocks are not cached: building the cache would
+ * cost too much, and their hash index is enough.
+ *
+ * Entries have a fixed size and come from their own slab cache, whose slabs
+ * are only freed after an RCU grace period, so that a lookup never reads
+ * freed memory, at worst an entry reused meanwhile, which the seqlock
+ * catches. They keep the 64-bit hash of the name and its first
+ * MYFS_DIR_CACHE_NAME_LEN bytes: a longer name found in the cache is checked
+ * in its block. The caches of all the directories are on an LRU list, oldest
+ * first, and a shrinker frees whole caches under memory pressure, skipping
+ * directories being changed.
+ */
+#define MYFS_DIR_CACHE_MAX_BLOCKS 256
+#define MYFS_DIR_CACHE_MIN_BUCKETS 16
+#define MYFS_DIR_CACHE_NAME_LEN 35 /* makes an entry 64 bytes */
+
+struct myfs_dir_cache_table {
+    unsigned int nr_buckets; /* power of 2 */
+    struct rcu_head rcu;
+    struct hlist_head buckets[];
+};
+
+struct myfs_dir_cache {
+    struct myfs_dir_cache_table __rcu *table; /* replaced when it grows */
+    unsigned int nr_entries;
+    struct inode *dir;
+    struct list_head lru; /* in myfs_dir_cache_lru */
+    struct rcu_head rcu;
+};
+
+struct myfs_dir_cache_entry {
+    struct hlist_node node;
+    uint64_t hash;
+    uint32_t ino;
+    uint8_t name_len;
+    char name[MYFS_DIR_CACHE_NAME_LEN]; /* first bytes of the name */
+};
+
+static struct kmem_cache *myfs_dir_cache_entry_cache;
+static LIST_HEAD(myfs_dir_cache_lru);
+static DEFINE_SPINLOCK(myfs_dir_cache_lock); /* Protects myfs_dir_cache_lru
+                                                and unpublishing caches */
+static atomic_long_t myfs_dir_cache_nr_entries; /* In all the caches */
+
+/* Lookup cache of dir, whose lock is held for writing */
+static inline struct myfs_dir_cache *myfs_dir_cache(struct inode *dir)
+{
+    return rcu_dereference_protected(
+        MYFS_INODE(dir)->i_dir_cache,
+        lockdep_is_held(&MYFS_INODE(dir)->i_dir_sem));
+}
+
+/* Table of cache of dir, whose lock is held for writing */
+static inline struct myfs_dir_cache_table *myfs_dir_cache_table(
+    struct inode *dir,
+    struct myfs_dir_cache *cache)
+{
+    return rcu_dereference_protected(
+        cache->table, lockdep_is_held(&MYFS_INODE(dir)->i_dir_sem));
+}
+
+static struct myfs_dir_cache_table *myfs_dir_cache_table_alloc(
+    unsigned int nr_buckets)
+{
+    struct myfs_dir_cache_table *table;
+    unsigned int i;
+
+    table = kvmalloc(struct_size(table, buckets, nr_buckets), GFP_NOFS);
+    if (!table)
+        return NULL;
+    table->nr_buckets = nr_buckets;
+    for (i = 0; i < nr_buckets; i++)
+        INIT_HLIST_HEAD(&table->buckets[i]);
+    return table;
+}
+
+/* Free cache, which no lookup can see anymore */
+static void myfs_dir_cache_free(struct myfs_dir_cache *cache)
+{
+    struct myfs_dir_cache_table *table =
+        rcu_dereference_protected(cache->table, true);
+    struct myfs_dir_cache_entry *ce;
+    struct hlist_node *tmp;
+    unsigned int i;
+
+    for (i = 0; i < table->nr_buckets; i++) {
+        hlist_for_each_entry_safe(ce, tmp, &table->buckets[i], node)
+            kmem_cache_free(myfs_dir_cache_entry_cache, ce);
+    }
+    atomic_long_sub(cache->nr_entries, &myfs_dir_cache_nr_entries);
+    kvfree(table);
+    kfree(cache);
+}
+
+static void myfs_dir_cache_free_rcu(struct rcu_head *head)
+{
+    myfs_dir_cache_free(container_of(head, struct myfs_dir_cache, rcu));
+}
+
+/*
+ * Free the lookup cache of dir, if any, once the lookups reading it are done.
+ * The lock of dir is held for writing, or dir is being destroyed.
+ */
+void myfs_dir_cache_drop(struct inode *dir)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(dir);
+    struct myfs_dir_cache *cache;
+
+    /* The shrinker may be freeing it */
+    spin_lock(&myfs_dir_cache_lock);
+    cache = rcu_dereference_protected(ci->i_dir_cache,
+                                      lockdep_is_held(&myfs_dir_cache_lock));
+    if (cache) {
+        list_del(&cache->lru);
+        RCU_INIT_POINTER(ci->i_dir_cache, NULL);
+    }
+    spin_unlock(&myfs_dir_cache_lock);
+
+    if (cache)
+        call_rcu(&cache->rcu, myfs_dir_cache_free_rcu);
+}
+
+static unsigned long myfs_dir_cache_count(struct shrinker *shrink,
+                                          struct shrink_control *sc)
+{
+    return atomic_long_read(&myfs_dir_cache_nr_entries) ?: SHRINK_EMPTY;
+}
+
+/*
+ * Free the oldest caches until sc->nr_to_scan entries are freed. Changes
+ * hold the directory lock while they update the cache, so the caches of
+ * locked directories are skipped. Lookups in flight are waited for by RCU.
+ */
+static unsigned long myfs_dir_cache_scan(struct shrinker *shrink,
+                                         struct shrink_control *sc)
+{
+    struct myfs_dir_cache *cache, *tmp;
+    unsigned long freed = 0;
+    LIST_HEAD(dispose);
+
+    spin_lock(&myfs_dir_cache_lock);
+    list_for_each_entry_safe(cache, tmp, &myfs_dir_cache_lru, lru) {
+        struct myfs_inode_info *ci = MYFS_INODE(cache->dir);
+
+        if (freed >= sc->nr_to_scan)
+            break;
+        if (!down_write_trylock(&ci->i_dir_sem))
+            continue;
+        RCU_INIT_POINTER(ci->i_dir_cache, NULL);
+        list_move(&cache->lru, &dispose);
+        up_write(&ci->i_dir_sem);
+        freed += cache->nr_entries;
+    }
+    spin_unlock(&myfs_dir_cache_lock);
+
+    list_for_each_entry_safe(cache, tmp, &dispose, lru)
+        call_rcu(&cache->rcu, myfs_dir_cache_free_rcu);
+    return freed;
+}
+
+static struct shrinker myfs_dir_cache_shrinker = {
+    .count_objects = myfs_dir_cache_count,
+    .scan_objects = myfs_dir_cache_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+
+int myfs_init_dir_cache(void)
+{
+    int ret;
+
+    myfs_dir_cache_entry_cache = kmem_cache_create(
+        "myfs_dir_cache_entry", sizeof(struct myfs_dir_cache_entry), 0,
+        SLAB_RECLAIM_ACCOUNT | SLAB_TYPESAFE_BY_RCU, NULL);
+    if (!myfs_dir_cache_entry_cache)
+        return -ENOMEM;
+    ret = register_shrinker(&myfs_dir_cache_shrinker);
+    if (ret)
+        kmem_cache_destroy(myfs_dir_cache_entry_cache);
+    return ret;
+}
+
+void myfs_destroy_dir_cache(void)
+{
+    unregister_shrinker(&myfs_dir_cache_shrinker);
+    /* Wait for the caches being freed by RCU */
+    rcu_barrier();
+    kmem_cache_destroy(myfs_dir_cache_entry_cache);
+}
+
+/*
+ * Double the number of buckets of cache of dir, moving its entries to a new
+ * table. Keep it as is on failure.
+ */
+static void myfs_dir_cache_grow(struct inode *dir,
+                                struct myfs_dir_cache *cache)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(dir);
+    struct myfs_dir_cache_table *old = myfs_dir_cache_table(dir, cache);
+    struct myfs_dir_cache_table *table;
+    struct myfs_dir_cache_entry *ce;
+    struct hlist_node *tmp;
+    unsigned int i;
+
+    table = myfs_dir_cache_table_alloc(old->nr_buckets * 2);
+    if (!table)
+        return;
+
+    write_seqlock(&ci->i_dir_seqlock);
+    for (i = 0; i < old->nr_buckets; i++) {
+        hlist_for_each_entry_safe(ce, tmp, &old->buckets[i], node) {
+            hlist_del_rcu(&ce->node);
+            hlist_add_head_rcu(
+                &ce->node,
+                &table->buckets[ce->hash & (table->nr_buckets - 1)]);
+        }
+    }
+    rcu_assign_pointer(cache->table, table);
+    write_sequnlock(&ci->i_dir_seqlock);
+
+    kvfree_rcu(old, rcu);
+}
+
+/*
+ * Return the entry of table of dir which may be name, of 64-bit hash `hash`,
+ * or NULL if name is not in the directory. A name longer than
+ * MYFS_DIR_CACHE_NAME_LEN is only known to match by its first bytes. Called
+ * under RCU and the seqlock of dir, or with its lock held for writing.
+ */
+static struct myfs_dir_cache_entry *myfs_dir_cache_find(
+    struct inode *dir,
+    struct myfs_dir_cache_table *table,
+    const struct qstr *name,
+    uint64_t hash)
+{
+    struct myfs_dir_cache_entry *ce;
+
+    hlist_for_each_entry_rcu(ce,
+                             &table->buckets[hash & (table->nr_buckets - 1)],
+                             node, lockdep_is_held(&MYFS_INODE(dir)->i_dir_sem))
+    {
+        if (ce->hash == hash && ce->name_len == name->len &&
+            !memcmp(ce->name, name->name,
+                    min_t(unsigned int, name->len, MYFS_DIR_CACHE_NAME_LEN)))
+            return ce;
+    }
+    return NULL;
+}
+
+static int myfs_dir_cache_insert(struct inode *dir,
+                                 struct myfs_dir_cache *cache,
+                                 const char *name,
+                                 unsigned int len,
+                                 uint32_t ino)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(dir);
+    struct myfs_dir_cache_table *table = myfs_dir_cache_table(dir, cache);
+    struct myfs_dir_cache_entry *ce;
+
+    ce = kmem_cache_alloc(myfs_dir_cache_entry_cache, GFP_NOFS);
+    if (!ce)
+        return -ENOMEM;
+    ce->hash = myfs_name_hash(dir, name, len);
+    ce->ino = ino;
+    ce->name_len = len;
+    memcpy(ce->name, name, min_t(unsigned int, len, MYFS_DIR_CACHE_NAME_LEN));
+
+    if (cache->nr_entries >= 2 * table->nr_buckets) {
+        myfs_dir_cache_grow(dir, cache);
+        table = myfs_dir_cache_table(dir, cache);
+    }
+    write_seqlock(&ci->i_dir_seqlock);
+    hlist_add_head_rcu(&ce->node,
+                       &table->buckets[ce->hash & (table->nr_buckets - 1)]);
+    write_sequnlock(&ci->i_dir_seqlock);
+    cache->nr_entries++;
+    atomic_long_inc(&myfs_dir_cache_nr_entries);
+    return 0;
+}
+
+/* Remove the entry of cache of dir for name, if any */
+static void myfs_dir_cache_remove(struct inode *dir,
+                                  struct myfs_dir_cache *cache,
+                                  const struct qstr *name)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(dir);
+    struct myfs_dir_cache_entry *ce;
+
+    ce = myfs_dir_cache_find(dir, myfs_dir_cache_table(dir, cache), name,
+                             myfs_name_hash(dir, name->name, name->len));
+    if (!ce)
+        return;
+
+    write_seqlock(&ci->i_dir_seqlock);
+    hlist_del_rcu(&ce->node);
+    write_sequnlock(&ci->i_dir_seqlock);
+    kmem_cache_free(myfs_dir_cache_entry_cache, ce);
+    cache->nr_entries--;
+    atomic_long_dec(&myfs_dir_cache_nr_entries);
+}
+
+/*
+ * Read all the entries of dir into a new cache. The lock of dir is held for
+ * writing.
+ */
+static struct myfs_dir_cache *myfs_dir_cache_build(struct inode *dir)
+{
+    struct myfs_dir_cache *cache;
+    struct myfs_dir_cache_table *table;
+    struct myfs_dir_entry *de;
+    struct buffer_head *bh;
+    uint32_t block, nblocks = myfs_dir_blocks(dir);
+    unsigned int off;
+    int ret = 0;
+
+    cache = kzalloc(sizeof(*cache), GFP_NOFS);
+    if (!cache)
+        return ERR_PTR(-ENOMEM);
+    cache->dir = dir;
+    INIT_LIST_HEAD(&cache->lru);
+    table = myfs_dir_cache_table_alloc(MYFS_DIR_CACHE_MIN_BUCKETS);
+    if (!table) {
+        kfree(cache);
+        return ERR_PTR(-ENOMEM);
+    }
+    RCU_INIT_POINTER(cache->table, table);
+
+    for (block = 0; block < nblocks && !ret; block++) {
+        bh = myfs_dir_bread_hole(dir, block);
+        if (!bh)
+            continue;
+        if (IS_ERR(bh)) {
+            ret = PTR_ERR(bh);
+            break;
+        }
+        for (off = 0; off < MYFS_BLOCK_SIZE && !ret; off += de->rec_len) {
+            de = myfs_block_entry(dir, bh->b_data, off);
+            if (!de)
+                ret = -EIO;
+            else if (de->inode)
+                ret = myfs_dir_cache_insert(dir, cache, de->name,
+                                            de->name_len, de->inode);
+        }
+        brelse(bh);
+    }
+
+    if (ret) {
+        myfs_dir_cache_free(cache);
+        return ERR_PTR(ret);
+    }
+    return cache;
+}
+
+/*
+ * Build the lookup cache of dir if it has none and can be cached. Keep going
+ * without it on failure.
+ */
+static void myfs_dir_cache_get(struct inode *dir)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(dir);
+    struct myfs_dir_cache *cache;
+
+    down_write(&ci->i_dir_sem);
+    /* Another lookup may have built it meanwhile */
+    if (myfs_dir_cache(dir) || myfs_dir_blocks(dir) > MYFS_DIR_CACHE_MAX_BLOCKS)
+        goto unlock;
+
+    cache = myfs_dir_cache_build(dir);
+    if (IS_ERR(cache))
+        goto unlock;
+    spin_lock(&myfs_dir_cache_lock);
+    list_add_tail(&cache->lru, &myfs_dir_cache_lru);
+    rcu_assign_pointer(ci->i_dir_cache, cache);
+    spin_unlock(&myfs_dir_cache_lock);
+
+unlock:
+    up_write(&ci->i_dir_sem);
+}
+
+/*
+ * Look name, of 64-bit hash `hash`, up in the lookup cache of dir without
+ * taking any lock. Return true and store its inode number in ino, or 0 if it
+ * does not exist, when the cache answers. Return false if dir has no cache,
+ * or if name is too long for the cache to tell.
+ */
+static bool myfs_dir_cache_lookup(struct inode *dir,
+                                  const struct qstr *name,
+                                  uint64_t hash,
+                                  uint32_t *ino)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(dir);
+    struct myfs_dir_cache *cache;
+    struct myfs_dir_cache_entry *ce;
+    unsigned int seq;
+    bool found;
+
+    rcu_read_lock();
+    do {
+        seq = read_seqbegin(&ci->i_dir_seqlock);
+        found = false;
+        cache = rcu_dereference(ci->i_dir_cache);
+        if (!cache)
+            break;
+        ce = myfs_dir_cache_find(dir, rcu_dereference(cache->table), name,
+                                 hash);
+        *ino = ce ? ce->ino : 0;
+        found = !ce || name->len <= MYFS_DIR_CACHE_NAME_LEN;
+    } while (read_seqretry(&ci->i_dir_seqlock, seq));
+    rcu_read_unlock();
+
+    return found;
+}
+
+/*
+ * Look name up in dir. Store its inode number in ino, or 0 if it does not
+ * exist.
+ */
+int myfs_dir_find(struct inode *dir, const struct qstr *name, uint32_t *ino)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(dir);
+    uint64_t hash = myfs_name_hash(dir, name->name, name->len);
+    struct buffer_head *bh;
+    struct myfs_dir_entry *de;
+
+    if (myfs_dir_cache_lookup(dir, name, hash, ino))
+        return 0;
+    if (!rcu_access_pointer(ci->i_dir_cache) &&
+        myfs_dir_blocks(dir) <= MYFS_DIR_CACHE_MAX_BLOCKS) {
+        myfs_dir_cache_get(dir);
+        if (myfs_dir_cache_lookup(dir, name, hash, ino))
+            return 0;
+    }
+
+    /* A long name only matched by its first bytes, or no cache */
+    *ino = 0;
+    down_read(&ci->i_dir_sem);
+    bh = myfs_dir_find_block(dir, name);
+    if (IS_ERR_OR_NULL(bh)) {
+        up_read(&ci->i_dir_sem);
+        return PTR_ERR_OR_ZERO(bh);
+    }
+
+    de = myfs_block_find(dir, bh->b_data, name);
+    if (!IS_ERR_OR_NULL(de))
+        *ino = de->inode;
+    brelse(bh);
+    up_read(&ci->i_dir_sem);
+
+    return PTR_ERR_OR_ZERO(de);
+}
+
+static int __myfs_dir_add(struct inode *dir,
+                          const struct qstr *name,
+                          struct inode *inode)
+{
+    struct myfs_dx_frame frames[MYFS_DX_MAX_DEPTH + 1];
+    struct myfs_dir_cache *cache;
+    struct buffer_head *bh;
+    uint32_t hash = myfs_dirhash(dir, name->name, name->len);
+    uint32_t block;
+    int nr, ret;
+
+    for (;;) {
+        nr = 0;
+        if (!myfs_dir_blocks(dir)) {
+            bh = myfs_dir_append(dir, &block);
+        } else if (MYFS_INODE(dir)->i_flags & MYFS_INODE_INDEX) {
+            nr = myfs_dx_probe(dir, hash, frames, &block);
+            if (nr < 0)
+                return nr;
+            bh = myfs_dir_bread(dir, block);
+        } else {
+            bh = myfs_dir_bread(dir, 0);
+        }
+        if (IS_ERR(bh)) {
+            myfs_dx_release(frames, nr);
+            return PTR_ERR(bh);
+        }
+
+        ret = myfs_block_add(dir, bh->b_data, name, inode);
+        if (!ret) {
+            mark_buffer_dirty(bh);
+            /* Drop the cache rather than letting it miss the entry */
+            cache = myfs_dir_cache(dir);
+            if (cache &&
+                (myfs_dir_blocks(dir) > MYFS_DIR_CACHE_MAX_BLOCKS ||
+                 myfs_dir_cache_insert(dir, cache, name->name, name->len,
+                                       inode->i_ino)))
+                myfs_dir_cache_drop(dir);
+        }
+        else if (ret == -ENOSPC && !nr)
+            ret = myfs_dx_create(dir, bh) ?: -EAGAIN;
+        else if (ret == -ENOSPC)
+            ret = myfs_dx_make_room(dir, frames, nr, bh) ?: -EAGAIN;
+
+        brelse(bh);
+        myfs_dx_release(frames, nr);
+        if (ret != -EAGAIN)
+            return ret;
+    }
+}
+
+/*
+ * Add an entry for inode named name in dir. The entry records the type of
+ * inode, so that readdir reports it without reading the inode.
+ */
+int myfs_dir_add(struct inode *dir,
+                 const struct qstr *name,
+                 struct inode *inode)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(dir);
+    int ret;
+
+    lockdep_assert_held_write(&dir->i_rwsem);
+
+    down_write(&ci->i_dir_sem);
+    ret = __myfs_dir_add(dir, name, inode);
+    up_write(&ci->i_dir_sem);
+    return ret;
+}
+
+static int __myfs_dir_remove(struct inode *dir, const struct qstr *name)
+{
+    struct myfs_dx_frame frames[MYFS_DX_MAX_DEPTH + 1];
+    struct buffer_head *bh;
+    struct myfs_dir_entry *de;
+    struct myfs_dir_cache *cache;
+    uint32_t block = 0;
+    unsigned int live, dead;
+    int nr = 0, ret;
+
+    if (!myfs_dir_blocks(dir))
+        return -ENOENT;
+    if (MYFS_INODE(dir)->i_flags & MYFS_INODE_INDEX) {
+        nr = myfs_dx_probe(dir, myfs_dirhash(dir, name->name, name->len),
+                           frames, &block);
+        if (nr < 0)
+            return nr;
+    }
+
+    bh = myfs_dir_bread(dir, block);
+    if (IS_ERR(bh)) {
+        myfs_dx_release(frames, nr);
+        return PTR_ERR(bh);
+    }
+    de = myfs_block_find(dir, bh->b_data, name);
+    if (IS_ERR_OR_NULL(de)) {
+        brelse(bh);
+        myfs_dx_release(frames, nr);
+        return de ? PTR_ERR(de) : -ENOENT;
+    }
+    ret = myfs_block_remove(dir, bh->b_data, de);
+    if (ret) {
+        brelse(bh);
+        myfs_dx_release(frames, nr);
+        return ret;
+    }
+
+    /* The entry is gone, tidying the block up is best effort */
+    if (myfs_block_usage(dir, bh->b_data, &live, &dead)) {
+        mark_buffer_dirty(bh);
+    } else if (!live && nr && myfs_dx_unlink(frames, nr)) {
+        myfs_dir_free_block(dir, bh, block);
+        bh = NULL;
+    } else {
+        /* Failing to compact leaves the block as it was */
+        if (dead > MYFS_BLOCK_MAX_TOMBSTONES)
+            myfs_block_compact(dir, bh->b_data);
+        mark_buffer_dirty(bh);
+    }
+    brelse(bh);
+    myfs_dx_release(frames, nr);
+
+    cache = myfs_dir_cache(dir);
+    if (cache)
+        myfs_dir_cache_remove(dir, cache, name);
+    return 0;
+}
+
+/*
+ * Remove the entry named name from dir. A block of an indexed directory left
+ * without entries is unlinked from the index and freed, so that lookups and
+ * readdir stop reading it. A block left with more than
+ * MYFS_BLOCK_MAX_TOMBSTONES tombstones is compacted.
+ */
+int myfs_dir_remove(struct inode *dir, const struct qstr *name)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(dir);
+    int ret;
+
+    lockdep_assert_held_write(&dir->i_rwsem);
+
+    down_write(&ci->i_dir_sem);
+    ret = __myfs_dir_remove(dir, name);
+    up_write(&ci->i_dir_sem);
+    return ret;
+}
+
+/* Return 1 if dir has no entries, 0 if it has some, or a negative error */
+int myfs_dir_is_empty(struct inode *dir)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(dir);
+    struct buffer_head *bh;
+    struct myfs_dir_entry *de;
+    uint32_t block, nblocks;
+    unsigned int off;
+    int ret = 1;
+
+    down_read(&ci->i_dir_sem);
+    nblocks = myfs_dir_blocks(dir);
+
+    /* Index blocks look empty, holes are skipped */
+    for (block = 0; block < nblocks && ret == 1; block++) {
+        bh = myfs_dir_bread_hole(dir, block);
+        if (!bh)
+            continue;
+        if (IS_ERR(bh)) {
+            ret = PTR_ERR(bh);
+            break;
+        }
+        for (off = 0; off < MYFS_BLOCK_SIZE; off += de->rec_len) {
+            de = myfs_block_entry(dir, bh->b_data, off);
+            if (!de || de->inode) {
+                ret = de ? 0 : -EIO;
+                break;
+            }
+        }
+        brelse(bh);
+    }
+    up_read(&ci->i_dir_sem);
+    return ret;
+}
+
+/*
+ * Readdir positions: past . and .., ctx->pos is 2 plus the top MYFS_POS_BITS
+ * bits of the 64-bit hash of the next entry to return (its key), or
+ * MYFS_POS_EOF at the end of the directory.
+ */
+#define MYFS_POS_BITS 62
+#define MYFS_POS_EOF (((loff_t) 1 << MYFS_POS_BITS) + 2)
+
+static inline uint64_t myfs_entry_key(struct inode *dir,
+                                      const struct myfs_dir_entry *de)
+{
+    return myfs_name_hash(dir, de->name, de->name_len) >> (64 - MYFS_POS_BITS);
+}
+
+/* Live record of a block, at offset off, sorted by key for readdir */
+struct myfs_dir_pos {
+    uint64_t key;
+    unsigned int off;
+};
+
+static int myfs_pos_cmp(const void *a, const void *b)
+{
+    const struct myfs_dir_pos *pa = a, *pb = b;
+
+    if (pa->key != pb->key)
+        return pa->key < pb->key ? -1 : 1;
+    return pa->off < pb->off ? -1 : pa->off > pb->off;
+}
+
+/*
+ * Store in hash the lowest hash covered after the block reached through the
+ * nr index frames. Return false if that block covers the highest hashes.
+ */
+static bool myfs_dx_next_hash(struct myfs_dx_frame *frames,
+                              int nr,
+                              uint32_t *hash)
+{
+    while (nr--) {
+        if (frames[nr].pos + 1 < frames[nr].node->count) {
+            *hash = frames[nr].node->entries[frames[nr].pos + 1].hash;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Emit the entries of block data of dir whose key is at least that of
+ * ctx->pos, in key order, using pos to sort them. Entries sharing a key are
+ * emitted together: ctx->pos only moves past a key once all of them are.
+ * Return 1 when done, 0 if ctx is full, or a negative error.
+ */
+static int myfs_block_emit(struct inode *dir,
+                           char *data,
+                           struct dir_context *ctx,
+                           struct myfs_dir_pos *pos)
+{
+    struct myfs_dir_entry *de;
+    uint64_t from = ctx->pos - 2;
+    unsigned int off;
+    int i, n = 0;
+
+    for (off = 0; off < MYFS_BLOCK_SIZE; off += de->rec_len) {
+        de = myfs_block_entry(dir, data, off);
+        if (!de)
+            return -EIO;
+        if (!de->inode)
+            continue;
+        pos[n].key = myfs_entry_key(dir, de);
+        pos[n].off = off;
+        if (pos[n].key >= from)
+            n++;
+    }
+    sort(pos, n, sizeof(*pos), myfs_pos_cmp, NULL);
+
+    for (i = 0; i < n; i++) {
+        de = (struct myfs_dir_entry *) (data + pos[i].off);
+        if (!dir_emit(ctx, de->name, de->name_len, de->inode,
+                      fs_ftype_to_dtype(de->file_type)))
+            return 0;
+        if (i + 1 == n || pos[i + 1].key != pos[i].key)
+            ctx->pos = 2 + pos[i].key + 1;
+    }
+    return 1;
+}
+
 /*
  * Iterate over the files contained in dir and commit them in ctx.
- * This function is called by the VFS while ctx->pos changes.
+ * This function is called by the VFS while ctx->pos changes. Each call walks
+ * the blocks of entries covering the hashes from ctx->pos: block 0 if dir is
+ * not indexed, or else the blocks in index order.
  * Return 0 on success.
  */
 static int myfs_iterate(struct file *dir, struct dir_context *ctx)
 {
     struct inode *inode = file_inode(dir);
-    struct myfs_inode_info *ci = MYFS_INODE(inode);
-    struct super_block *sb = inode->i_sb;
-    struct buffer_head *bh = NULL;
-    struct myfs_dir_block *dblock = NULL;
-    struct myfs_file *f = NULL;
-    int i;
+    struct myfs_dx_frame frames[MYFS_DX_MAX_DEPTH + 1];
+    struct myfs_dir_pos *pos;
+    struct buffer_head *bh;
+    uint32_t block, next;
+    bool last;
+    int nr, ret = 0;
 
     /* Check that dir is a directory */
     if (!S_ISDIR(inode->i_mode))
         return -ENOTDIR;
 
-    /*
-     * Check that ctx->pos is not bigger than what we can handle (including
-     * . and ..)
-     */
-    if (ctx->pos > MYFS_MAX_SUBFILES + 2)
-        return 0;
-
     /* Commit . and .. to ctx */
     if (!dir_emit_dots(dir, ctx))
         return 0;
+    if (ctx->pos >= MYFS_POS_EOF)
+        return 0;
+    if (!myfs_dir_blocks(inode)) {
+        ctx->pos = MYFS_POS_EOF;
+        return 0;
+    }
 
-    /* Read the directory index block on disk */
-    bh = sb_bread(sb, ci->dir_block);
-    if (!bh)
-        return -EIO;
-    dblock = (struct myfs_dir_block *) bh->b_data;
+    pos = kmalloc_array(MYFS_BLOCK_MAX_ENTRIES, sizeof(*pos), GFP_KERNEL);
+    if (!pos)
+        return -ENOMEM;
+
+    down_read(&MYFS_INODE(inode)->i_dir_sem);
+    while (ctx->pos < MYFS_POS_EOF) {
+        block = 0;
+        last = true;
+        if (MYFS_INODE(inode)->i_flags & MYFS_INODE_INDEX) {
+            nr = myfs_dx_probe(inode,
+                               (ctx->pos - 2) >> (MYFS_POS_BITS - 32),
+                               frames, &block);
+            if (nr < 0) {
+                ret = nr;
+                break;
+            }
+            last = !myfs_dx_next_hash(frames, nr, &next);
+            myfs_dx_release(frames, nr);
+        }
 
-    /* Iterate over the index block and commit subfiles */
-    for (i = ctx->pos - 2; i < MYFS_MAX_SUBFILES; i++) {
-        f = &dblock->files[i];
-        if (!f->inode)
+        bh = myfs_dir_bread(inode, block);
+        if (IS_ERR(bh)) {
+            ret = PTR_ERR(bh);
             break;
-        if (!dir_emit(ctx, f->filename, MYFS_FILENAME_LEN, f->inode,
-                      DT_UNKNOWN))
+        }
+        ret = myfs_block_emit(inode, bh->b_data, ctx, pos);
+        brelse(bh);
+        if (ret <= 0)
             break;
-        ctx->pos++;
-    }
+        ret = 0;
 
-    brelse(bh);
+        if (last)
+            ctx->pos = MYFS_POS_EOF;
+        else
+            ctx->pos = 2 + ((loff_t) next << (MYFS_POS_BITS - 32));
+    }
+    up_read(&MYFS_INODE(inode)->i_dir_sem);
 
-    return 0;
+    kfree(pos);
+    return ret;
 }
 
 const struct file_operations myfs_dir_ops = {
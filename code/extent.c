@@ -1,24 +1,949 @@
+#define pr_fmt(fmt) "myfs: " fmt
+
+#include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/slab.h>
 
+#include "bitmap.h"
 #include "myfs.h"
 
 /*
- * Search the extent which contain the target block.
- * Retrun the first unused file index if not found.
- * Return -1 if it is out of range.
- * TODO: use binary search.
+ * Binary search the extent which contains iblock among the nr first extents
+ * of the array, which are sorted by logical block.
+ * Return its index, or -1 if no extent contains iblock.
  */
-uint32_t myfs_ext_search(struct myfs_file_ei_block *index,
-                             uint32_t iblock)
+int myfs_ext_lookup(const struct myfs_extent *extents,
+                    uint32_t nr,
+                    uint32_t iblock)
 {
-    uint32_t i;
-    for (i = 0; i < MYFS_MAX_EXTENTS; i++) {
-        uint32_t block = index->extents[i].ee_block;
-        uint32_t len = index->extents[i].ee_len;
-        if (index->extents[i].ee_start == 0 ||
-            (iblock >= block && iblock < block + len))
-            return i;
+    uint32_t lo = 0, hi = nr;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (iblock < extents[mid].ee_block)
+            hi = mid;
+        else if (iblock >= extents[mid].ee_block + extents[mid].ee_len)
+            lo = mid + 1;
+        else
+            return mid;
     }
     return -1;
 }
+
+/*
+ * Extent tree. The root node is the block ei_block of the inode, it never
+ * moves: when it is full, its entries are moved to a new child and it becomes
+ * an index node one level higher. Other full nodes are split in two. Lookups
+ * and updates go down from the root along a path of nodes, so they read
+ * depth + 1 blocks.
+ */
+struct myfs_ext_path {
+    struct buffer_head *p_bh;
+    struct myfs_file_ei_block *p_node;
+    int p_pos; /* entry of the node on the path, -1 if none */
+};
+
+static uint32_t myfs_ext_node_max(struct myfs_file_ei_block *node)
+{
+    return node->header.eh_depth ? MYFS_EXT_IDX_MAX : MYFS_EXT_LEAF_MAX;
+}
+
+static size_t myfs_ext_entry_size(struct myfs_file_ei_block *node)
+{
+    return node->header.eh_depth ? sizeof(struct myfs_extent_idx)
+                                 : sizeof(struct myfs_extent);
+}
+
+static void *myfs_ext_entry(struct myfs_file_ei_block *node, uint32_t i)
+{
+    return node->header.eh_depth ? (void *) &node->idx[i]
+                                 : (void *) &node->extents[i];
+}
+
+/* First logical block covered by the i-th entry of node */
+static uint32_t myfs_ext_key(struct myfs_file_ei_block *node, uint32_t i)
+{
+    return node->header.eh_depth ? node->idx[i].ix_block
+                                 : node->extents[i].ee_block;
+}
+
+/* Return the last entry of node starting at or before iblock, or -1 */
+static int myfs_ext_node_search(struct myfs_file_ei_block *node,
+                                uint32_t iblock)
+{
+    uint32_t lo = 0, hi = node->header.eh_entries;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (myfs_ext_key(node, mid) <= iblock)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (int) lo - 1;
+}
+
+static void myfs_ext_path_release(struct myfs_ext_path *path, int depth)
+{
+    int i;
+
+    for (i = 0; i <= depth; i++)
+        brelse(path[i].p_bh);
+}
+
+/*
+ * Read the path from the root to the leaf which should contain iblock.
+ * Return the depth of the tree, or a negative error code.
+ */
+static int myfs_ext_find_path(struct inode *inode,
+                              uint32_t iblock,
+                              struct myfs_ext_path *path)
+{
+    struct super_block *sb = inode->i_sb;
+    uint32_t bno = MYFS_INODE(inode)->ei_block;
+    int level = 0, depth = 0;
+
+    for (;;) {
+        struct myfs_file_ei_block *node;
+        struct buffer_head *bh = sb_bread(sb, bno);
+
+        if (!bh)
+            goto failed;
+        node = (struct myfs_file_ei_block *) bh->b_data;
+        path[level].p_bh = bh;
+        path[level].p_node = node;
+        path[level].p_pos = myfs_ext_node_search(node, iblock);
+
+        if (!level)
+            depth = node->header.eh_depth;
+        if (depth > MYFS_EXT_MAX_DEPTH ||
+            node->header.eh_depth != depth - level ||
+            node->header.eh_entries > myfs_ext_node_max(node)) {
+            pr_err("corrupted extent tree node %u\n", bno);
+            level++;
+            goto failed;
+        }
+        if (level == depth)
+            return depth;
+
+        /* Index nodes are never empty */
+        if (!node->header.eh_entries) {
+            pr_err("empty extent tree index node %u\n", bno);
+            level++;
+            goto failed;
+        }
+        if (path[level].p_pos < 0)
+            path[level].p_pos = 0;
+        bno = node->idx[path[level].p_pos].ix_leaf;
+        level++;
+    }
+
+failed:
+    myfs_ext_path_release(path, level - 1);
+    return -EIO;
+}
+
+/* Allocate and initialize a new node block, near goal */
+static struct buffer_head *myfs_ext_new_node(struct super_block *sb,
+                                             uint32_t goal)
+{
+    struct buffer_head *bh;
+    uint32_t bno = get_free_blocks(MYFS_SB(sb), goal, 1);
+
+    if (!bno)
+        return ERR_PTR(-ENOSPC);
+    bh = sb_getblk(sb, bno);
+    if (!bh) {
+        put_blocks(MYFS_SB(sb), bno, 1);
+        return ERR_PTR(-EIO);
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, MYFS_BLOCK_SIZE);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+
+    return bh;
+}
+
+/* Move the entries of the root to a new child and make it point to it */
+static int myfs_ext_grow(struct super_block *sb, struct myfs_ext_path *path)
+{
+    struct myfs_file_ei_block *root = path[0].p_node;
+    struct buffer_head *bh;
+
+    if (root->header.eh_depth >= MYFS_EXT_MAX_DEPTH)
+        return -EFBIG;
+
+    bh = myfs_ext_new_node(sb, path[0].p_bh->b_blocknr + 1);
+    if (IS_ERR(bh))
+        return PTR_ERR(bh);
+    memcpy(bh->b_data, root, MYFS_BLOCK_SIZE);
+    mark_buffer_dirty(bh);
+
+    root->idx[0].ix_block = myfs_ext_key(root, 0);
+    root->idx[0].ix_leaf = bh->b_blocknr;
+    memset(&root->idx[1], 0,
+           MYFS_BLOCK_SIZE - offsetof(struct myfs_file_ei_block, idx[1]));
+    root->header.eh_entries = 1;
+    root->header.eh_depth++;
+    mark_buffer_dirty(path[0].p_bh);
+    brelse(bh);
+
+    return 0;
+}
+
+/*
+ * Split the node at the given level of path in two, the parent having room
+ * for one more entry. When the path goes through the last entry, which is the
+ * common case of a file growing at its end, only this entry is moved to the
+ * new node so that the old one stays full.
+ */
+static int myfs_ext_split(struct super_block *sb,
+                          struct myfs_ext_path *path,
+                          int level)
+{
+    struct myfs_file_ei_block *node = path[level].p_node, *new;
+    struct myfs_file_ei_block *parent = path[level - 1].p_node;
+    uint32_t nr = node->header.eh_entries, pos = path[level - 1].p_pos + 1;
+    uint32_t split = nr / 2;
+    size_t size = myfs_ext_entry_size(node);
+    struct buffer_head *bh;
+
+    if (path[level].p_pos == (int) nr - 1)
+        split = nr - 1;
+
+    bh = myfs_ext_new_node(sb, path[level].p_bh->b_blocknr + 1);
+    if (IS_ERR(bh))
+        return PTR_ERR(bh);
+    new = (struct myfs_file_ei_block *) bh->b_data;
+    new->header.eh_depth = node->header.eh_depth;
+    new->header.eh_entries = nr - split;
+    memcpy(myfs_ext_entry(new, 0), myfs_ext_entry(node, split),
+           (nr - split) * size);
+    mark_buffer_dirty(bh);
+
+    memset(myfs_ext_entry(node, split), 0, (nr - split) * size);
+    node->header.eh_entries = split;
+    mark_buffer_dirty(path[level].p_bh);
+
+    memmove(&parent->idx[pos + 1], &parent->idx[pos],
+            (parent->header.eh_entries - pos) * sizeof(struct myfs_extent_idx));
+    parent->idx[pos].ix_block = myfs_ext_key(new, 0);
+    parent->idx[pos].ix_leaf = bh->b_blocknr;
+    parent->header.eh_entries++;
+    mark_buffer_dirty(path[level - 1].p_bh);
+    brelse(bh);
+
+    return 0;
+}
+
+/*
+ * Read the path to the leaf which should contain iblock, splitting nodes
+ * until that leaf has room for nr more extents.
+ * Return the depth of the tree, or a negative error code.
+ */
+static int myfs_ext_find_room(struct inode *inode,
+                              uint32_t iblock,
+                              uint32_t nr,
+                              struct myfs_ext_path *path)
+{
+    struct super_block *sb = inode->i_sb;
+    int depth, level, ret;
+
+    for (;;) {
+        depth = myfs_ext_find_path(inode, iblock, path);
+        if (depth < 0)
+            return depth;
+        if (path[depth].p_node->header.eh_entries + nr <= MYFS_EXT_LEAF_MAX)
+            return depth;
+
+        /* Split the lowest node whose parent has room, or grow the root */
+        for (level = depth; level > 0; level--) {
+            if (path[level - 1].p_node->header.eh_entries < MYFS_EXT_IDX_MAX)
+                break;
+        }
+        if (level)
+            ret = myfs_ext_split(sb, path, level);
+        else
+            ret = myfs_ext_grow(sb, path);
+        myfs_ext_path_release(path, depth);
+        if (ret)
+            return ret;
+    }
+}
+
+/*
+ * Look up the extent containing iblock in the tree of inode.
+ * Return 1 and copy it to ext if found. Otherwise, return 0 and copy the last
+ * extent before iblock if any, or zeroes. Return a negative error code on
+ * failure. i_map_sem must be held.
+ */
+int myfs_ext_find(struct inode *inode,
+                  uint32_t iblock,
+                  struct myfs_extent *ext)
+{
+    struct myfs_ext_path path[MYFS_EXT_MAX_DEPTH + 1];
+    struct myfs_file_ei_block *leaf;
+    int depth, pos, ret = 0;
+
+    depth = myfs_ext_find_path(inode, iblock, path);
+    if (depth < 0)
+        return depth;
+    leaf = path[depth].p_node;
+    pos = path[depth].p_pos;
+
+    memset(ext, 0, sizeof(*ext));
+    if (pos >= 0) {
+        *ext = leaf->extents[pos];
+        ret = iblock < ext->ee_block + ext->ee_len;
+    }
+    myfs_ext_path_release(path, depth);
+
+    return ret;
+}
+
+/*
+ * Return true if extent b directly follows extent a, logically and
+ * physically, with the same flags.
+ */
+static bool myfs_ext_mergeable(struct myfs_extent *a, struct myfs_extent *b)
+{
+    return a->ee_flags == b->ee_flags &&
+           a->ee_block + a->ee_len == b->ee_block &&
+           a->ee_start + a->ee_len == b->ee_start &&
+           a->ee_len + b->ee_len <= MYFS_MAX_BLOCKS_PER_EXTENT;
+}
+
+/*
+ * After the first entry of the node at the given level changed to key,
+ * update the keys of its ancestors which are greater.
+ */
+static void myfs_ext_fix_keys(struct myfs_ext_path *path,
+                              int level,
+                              uint32_t key)
+{
+    while (level-- > 0) {
+        struct myfs_extent_idx *ix = &path[level].p_node->idx[path[level].p_pos];
+
+        if (ix->ix_block <= key)
+            break;
+        ix->ix_block = key;
+        mark_buffer_dirty(path[level].p_bh);
+        if (path[level].p_pos)
+            break;
+    }
+}
+
+/*
+ * The extent cache (see below) mirrors the leaves of the tree entry for entry,
+ * so that a cached extent can be passed to myfs_ext_set_flags(). When it is
+ * loaded, changes to the tree are applied to it in place. Room is made in the
+ * cache before the tree is changed, so that it is never left stale.
+ */
+
+/* Make room for nr more extents in the extent cache of inode, if loaded */
+static int myfs_ext_cache_reserve(struct inode *inode, uint32_t nr)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+    struct myfs_extent *extents;
+    uint32_t max;
+
+    if (!ci->i_extents_valid || ci->i_nr_extents + nr <= ci->i_max_extents)
+        return 0;
+
+    max = max(2 * ci->i_max_extents, ci->i_nr_extents + nr);
+    extents = krealloc(ci->i_extents, max * sizeof(struct myfs_extent),
+                       GFP_NOFS);
+    if (!extents)
+        return -ENOMEM;
+    ci->i_extents = extents;
+    ci->i_max_extents = max;
+
+    return 0;
+}
+
+/* Return the number of cached extents of inode starting before iblock */
+static uint32_t myfs_ext_cache_pos(struct inode *inode, uint32_t iblock)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+    uint32_t lo = 0, hi = ci->i_nr_extents;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ci->i_extents[mid].ee_block < iblock)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Replace the nr_old cached extents of inode from index i by the nr_new
+ * extents of new, if the cache is loaded. Room must have been reserved.
+ */
+static void myfs_ext_cache_replace(struct inode *inode,
+                                   uint32_t i,
+                                   uint32_t nr_old,
+                                   const struct myfs_extent *new,
+                                   uint32_t nr_new)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+
+    if (!ci->i_extents_valid)
+        return;
+    memmove(&ci->i_extents[i + nr_new], &ci->i_extents[i + nr_old],
+            (ci->i_nr_extents - i - nr_old) * sizeof(struct myfs_extent));
+    memcpy(&ci->i_extents[i], new, nr_new * sizeof(struct myfs_extent));
+    ci->i_nr_extents = ci->i_nr_extents - nr_old + nr_new;
+    ci->i_map_seq++;
+}
+
+/*
+ * Insert extent new, which must not overlap existing ones, in the tree of
+ * inode. It is merged with the previous extent when possible.
+ * Return 0 or a negative error code. i_map_sem must be held for writing.
+ */
+int myfs_ext_insert(struct inode *inode, const struct myfs_extent *new)
+{
+    struct myfs_ext_path path[MYFS_EXT_MAX_DEPTH + 1];
+    struct myfs_file_ei_block *leaf;
+    struct myfs_extent ext = *new;
+    uint32_t i;
+    int depth, pos, ret;
+
+    ret = myfs_ext_cache_reserve(inode, 1);
+    if (ret)
+        return ret;
+    depth = myfs_ext_find_room(inode, new->ee_block, 1, path);
+    if (depth < 0)
+        return depth;
+    leaf = path[depth].p_node;
+    pos = path[depth].p_pos;
+    i = myfs_ext_cache_pos(inode, ext.ee_block);
+
+    if (pos >= 0 && myfs_ext_mergeable(&leaf->extents[pos], &ext)) {
+        leaf->extents[pos].ee_len += ext.ee_len;
+        myfs_ext_cache_replace(inode, i - 1, 1, &leaf->extents[pos], 1);
+    } else {
+        pos++;
+        memmove(&leaf->extents[pos + 1], &leaf->extents[pos],
+                (leaf->header.eh_entries - pos) * sizeof(struct myfs_extent));
+        leaf->extents[pos] = ext;
+        leaf->header.eh_entries++;
+        if (!pos)
+            myfs_ext_fix_keys(path, depth, ext.ee_block);
+        myfs_ext_cache_replace(inode, i, 0, &ext, 1);
+    }
+    mark_buffer_dirty(path[depth].p_bh);
+    myfs_ext_path_release(path, depth);
+
+    return 0;
+}
+
+/* Remove the i-th extent from leaf */
+static void myfs_ext_remove(struct myfs_file_ei_block *leaf, uint32_t i)
+{
+    uint32_t nr = leaf->header.eh_entries;
+
+    memmove(&leaf->extents[i], &leaf->extents[i + 1],
+            (nr - i - 1) * sizeof(struct myfs_extent));
+    memset(&leaf->extents[nr - 1], 0, sizeof(struct myfs_extent));
+    leaf->header.eh_entries--;
+}
+
+/*
+ * Set the flags of blocks [iblock, iblock + len), which must be covered by a
+ * single extent. The range is moved to the adjacent extent of the same leaf
+ * if it is at the edge of the extent and can be merged with it; otherwise the
+ * extent is split in up to three extents.
+ * Return 0 or a negative error code. i_map_sem must be held for writing.
+ */
+int myfs_ext_set_flags(struct inode *inode,
+                       uint32_t iblock,
+                       uint32_t len,
+                       uint16_t flags)
+{
+    struct myfs_ext_path path[MYFS_EXT_MAX_DEPTH + 1];
+    struct myfs_file_ei_block *leaf;
+    struct myfs_extent *ext, orig, range;
+    uint32_t head, tail, nr_new, c;
+    int depth, i, ret;
+
+    /* A split adds up to two extents */
+    ret = myfs_ext_cache_reserve(inode, 2);
+    if (ret)
+        return ret;
+    depth = myfs_ext_find_path(inode, iblock, path);
+    if (depth < 0)
+        return depth;
+    leaf = path[depth].p_node;
+    i = path[depth].p_pos;
+    if (i < 0 || iblock + len > leaf->extents[i].ee_block +
+                                    leaf->extents[i].ee_len) {
+        ret = -EINVAL;
+        goto release;
+    }
+    orig = leaf->extents[i];
+    if (orig.ee_flags == flags)
+        goto release;
+    c = myfs_ext_cache_pos(inode, orig.ee_block);
+
+    head = iblock - orig.ee_block;
+    tail = orig.ee_block + orig.ee_len - (iblock + len);
+    nr_new = !!head + !!tail;
+
+    range.ee_block = iblock;
+    range.ee_len = len;
+    range.ee_flags = flags;
+    range.ee_start = orig.ee_start + head;
+
+    /* Range at the start of extent i: try to append it to the previous one */
+    if (!head && i > 0 && myfs_ext_mergeable(&leaf->extents[i - 1], &range)) {
+        ext = &leaf->extents[i];
+        leaf->extents[i - 1].ee_len += len;
+        if (!tail) {
+            myfs_ext_remove(leaf, i);
+        } else {
+            ext->ee_block += len;
+            ext->ee_start += len;
+            ext->ee_len -= len;
+        }
+        myfs_ext_cache_replace(inode, c - 1, 2, &leaf->extents[i - 1],
+                               tail ? 2 : 1);
+        goto dirty;
+    }
+
+    /* Range at the end of extent i: try to prepend it to the next one */
+    if (!tail && i + 1 < leaf->header.eh_entries &&
+        myfs_ext_mergeable(&range, &leaf->extents[i + 1])) {
+        struct myfs_extent *next = &leaf->extents[i + 1];
+
+        next->ee_block = range.ee_block;
+        next->ee_start = range.ee_start;
+        next->ee_len += len;
+        if (!head)
+            myfs_ext_remove(leaf, i);
+        else
+            leaf->extents[i].ee_len -= len;
+        myfs_ext_cache_replace(inode, c, 2, &leaf->extents[i], head ? 2 : 1);
+        goto dirty;
+    }
+
+    /* Make room for the split, the path may change */
+    if (leaf->header.eh_entries + nr_new > MYFS_EXT_LEAF_MAX) {
+        myfs_ext_path_release(path, depth);
+        depth = myfs_ext_find_room(inode, iblock, nr_new, path);
+        if (depth < 0)
+            return depth;
+        leaf = path[depth].p_node;
+        i = path[depth].p_pos;
+    }
+
+    memmove(&leaf->extents[i + 1 + nr_new], &leaf->extents[i + 1],
+            (leaf->header.eh_entries - i - 1) * sizeof(struct myfs_extent));
+    leaf->header.eh_entries += nr_new;
+    ext = &leaf->extents[i];
+    if (head) {
+        ext->ee_len = head;
+        ext++;
+    }
+    *ext = range;
+    if (tail) {
+        ext[1].ee_block = iblock + len;
+        ext[1].ee_len = tail;
+        ext[1].ee_flags = orig.ee_flags;
+        ext[1].ee_start = range.ee_start + len;
+    }
+    myfs_ext_cache_replace(inode, c, 1, &leaf->extents[i], 1 + nr_new);
+
+dirty:
+    mark_buffer_dirty(path[depth].p_bh);
+release:
+    myfs_ext_path_release(path, depth);
+
+    return ret;
+}
+
+/*
+ * Free the empty node at the given level of path and remove it from its
+ * parent, which is freed as well if it becomes empty. An empty root becomes
+ * an empty leaf.
+ */
+static void myfs_ext_free_node(struct super_block *sb,
+                               struct myfs_ext_path *path,
+                               int level)
+{
+    for (; level > 0; level--) {
+        struct myfs_file_ei_block *parent = path[level - 1].p_node;
+        uint32_t pos = path[level - 1].p_pos;
+        uint32_t bno = path[level].p_bh->b_blocknr;
+
+        /* Drop the buffer so that it is never written to the freed block */
+        bforget(path[level].p_bh);
+        path[level].p_bh = NULL;
+        put_blocks(MYFS_SB(sb), bno, 1);
+
+        memmove(&parent->idx[pos], &parent->idx[pos + 1],
+                (parent->header.eh_entries - pos - 1) *
+                    sizeof(struct myfs_extent_idx));
+        parent->header.eh_entries--;
+        memset(&parent->idx[parent->header.eh_entries], 0,
+               sizeof(struct myfs_extent_idx));
+        mark_buffer_dirty(path[level - 1].p_bh);
+        if (parent->header.eh_entries)
+            return;
+    }
+
+    path[0].p_node->header.eh_depth = 0;
+}
+
+/*
+ * Remove blocks [iblock, iblock + len), which must be covered by a single
+ * extent, from the tree of inode and free them. The extent is cut, or split
+ * in two around the range; a leaf that becomes empty is freed.
+ * Return 0 or a negative error code. i_map_sem must be held for writing.
+ */
+int myfs_ext_remove_blocks(struct inode *inode,
+                           uint32_t iblock,
+                           uint32_t len)
+{
+    struct super_block *sb = inode->i_sb;
+    struct myfs_ext_path path[MYFS_EXT_MAX_DEPTH + 1];
+    struct myfs_file_ei_block *leaf;
+    struct myfs_extent *ext, orig;
+    uint32_t head, tail, c;
+    int depth, i, ret;
+
+    /* A split adds one extent */
+    ret = myfs_ext_cache_reserve(inode, 1);
+    if (ret)
+        return ret;
+    depth = myfs_ext_find_path(inode, iblock, path);
+    if (depth < 0)
+        return depth;
+    leaf = path[depth].p_node;
+    i = path[depth].p_pos;
+    if (i < 0 || iblock + len > leaf->extents[i].ee_block +
+                                    leaf->extents[i].ee_len) {
+        myfs_ext_path_release(path, depth);
+        return -EINVAL;
+    }
+    orig = leaf->extents[i];
+    c = myfs_ext_cache_pos(inode, orig.ee_block);
+    head = iblock - orig.ee_block;
+    tail = orig.ee_block + orig.ee_len - (iblock + len);
+
+    /* Make room for the split, the path may change */
+    if (head && tail && leaf->header.eh_entries == MYFS_EXT_LEAF_MAX) {
+        myfs_ext_path_release(path, depth);
+        depth = myfs_ext_find_room(inode, iblock, 1, path);
+        if (depth < 0)
+            return depth;
+        leaf = path[depth].p_node;
+        i = path[depth].p_pos;
+    }
+
+    ext = &leaf->extents[i];
+    if (head && tail) {
+        memmove(&leaf->extents[i + 2], &leaf->extents[i + 1],
+                (leaf->header.eh_entries - i - 1) * sizeof(struct myfs_extent));
+        leaf->header.eh_entries++;
+        ext->ee_len = head;
+        ext[1].ee_block = iblock + len;
+        ext[1].ee_len = tail;
+        ext[1].ee_flags = orig.ee_flags;
+        ext[1].ee_start = orig.ee_start + head + len;
+        myfs_ext_cache_replace(inode, c, 1, ext, 2);
+    } else if (head || tail) {
+        /* Parent keys may stay below the first extent, they still separate */
+        if (tail) {
+            ext->ee_block += len;
+            ext->ee_start += len;
+        }
+        ext->ee_len -= len;
+        myfs_ext_cache_replace(inode, c, 1, ext, 1);
+    } else {
+        myfs_ext_remove(leaf, i);
+        myfs_ext_cache_replace(inode, c, 1, NULL, 0);
+    }
+    mark_buffer_dirty(path[depth].p_bh);
+    if (!leaf->header.eh_entries && depth)
+        myfs_ext_free_node(sb, path, depth);
+    myfs_ext_path_release(path, depth);
+
+    clean_bdev_aliases(sb->s_bdev, orig.ee_start + head, len);
+    put_blocks(MYFS_SB(sb), orig.ee_start + head, len);
+
+    return 0;
+}
+
+/*
+ * Remove blocks from block `from` to the end of the file from the tree of
+ * inode and free them, along with the nodes that become empty. If zero is
+ * set, written blocks are overwritten with zeroes first.
+ * Return 0 or a negative error code. i_map_sem must be held for writing.
+ */
+int myfs_ext_truncate(struct inode *inode, uint32_t from, bool zero)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+    struct super_block *sb = inode->i_sb;
+    struct myfs_ext_path path[MYFS_EXT_MAX_DEPTH + 1];
+
+    /* Remove extents from the end, one at a time */
+    for (;;) {
+        struct myfs_file_ei_block *leaf;
+        struct myfs_extent *ext;
+        uint32_t start, len;
+        int depth = myfs_ext_find_path(inode, U32_MAX, path);
+
+        if (depth < 0)
+            return depth;
+        leaf = path[depth].p_node;
+        if (!leaf->header.eh_entries) {
+            myfs_ext_path_release(path, depth);
+            return 0;
+        }
+        ext = &leaf->extents[leaf->header.eh_entries - 1];
+        if (ext->ee_block + ext->ee_len <= from) {
+            myfs_ext_path_release(path, depth);
+            return 0;
+        }
+
+        if (ext->ee_block >= from) {
+            start = ext->ee_start;
+            len = ext->ee_len;
+        } else {
+            start = ext->ee_start + from - ext->ee_block;
+            len = ext->ee_block + ext->ee_len - from;
+        }
+        if (zero && !(ext->ee_flags & MYFS_EXT_UNWRITTEN))
+            sb_issue_zeroout(sb, start, len, GFP_NOFS);
+        /* Directory blocks are in the buffer cache, never write them back */
+        clean_bdev_aliases(sb->s_bdev, start, len);
+        put_blocks(MYFS_SB(sb), start, len);
+
+        /* The last cached extent is the last one of the tree */
+        if (len < ext->ee_len) {
+            ext->ee_len -= len;
+            myfs_ext_cache_replace(inode, ci->i_nr_extents - 1, 1, ext, 1);
+        } else {
+            myfs_ext_remove(leaf, leaf->header.eh_entries - 1);
+            myfs_ext_cache_replace(inode, ci->i_nr_extents - 1, 1, NULL, 0);
+        }
+        mark_buffer_dirty(path[depth].p_bh);
+        if (!leaf->header.eh_entries && depth)
+            myfs_ext_free_node(sb, path, depth);
+        myfs_ext_path_release(path, depth);
+    }
+}
+
+/* Walk the subtree of node bno, of the given depth (-1 for the root) */
+static int myfs_ext_walk_node(struct super_block *sb,
+                              uint32_t bno,
+                              int depth,
+                              int (*fn)(struct myfs_extent *ext, void *data),
+                              void *data)
+{
+    struct buffer_head *bh = sb_bread(sb, bno);
+    struct myfs_file_ei_block *node;
+    uint32_t i;
+    int ret = 0;
+
+    if (!bh)
+        return -EIO;
+    node = (struct myfs_file_ei_block *) bh->b_data;
+    if (depth < 0)
+        depth = node->header.eh_depth;
+    if (depth > MYFS_EXT_MAX_DEPTH || node->header.eh_depth != depth ||
+        node->header.eh_entries > myfs_ext_node_max(node)) {
+        pr_err("corrupted extent tree node %u\n", bno);
+        brelse(bh);
+        return -EIO;
+    }
+
+    for (i = 0; i < node->header.eh_entries && !ret; i++) {
+        if (depth)
+            ret = myfs_ext_walk_node(sb, node->idx[i].ix_leaf, depth - 1, fn,
+                                     data);
+        else
+            ret = fn(&node->extents[i], data);
+    }
+    brelse(bh);
+
+    return ret;
+}
+
+/*
+ * Call fn on each extent of inode, in logical order, until it returns
+ * non-zero. Return the last value returned by fn, or a negative error code.
+ * i_map_sem must be held.
+ */
+int myfs_ext_walk(struct inode *inode,
+                  int (*fn)(struct myfs_extent *ext, void *data),
+                  void *data)
+{
+    return myfs_ext_walk_node(inode->i_sb, MYFS_INODE(inode)->ei_block, -1,
+                              fn, data);
+}
+
+/*
+ * Per-inode extent cache: a copy of all the extents of the tree, loaded on
+ * first access, so that mapping a block needs neither buffer cache lookups
+ * nor a walk down the tree. It is protected by i_map_sem. Changes to the tree
+ * update it in place and bump i_map_seq; it is only dropped when the blocks
+ * of the inode are freed.
+ */
+
+struct myfs_ext_cache_fill {
+    struct myfs_extent *extents;
+    uint32_t nr;
+};
+
+static int myfs_ext_cache_count(struct myfs_extent *ext, void *data)
+{
+    ((struct myfs_ext_cache_fill *) data)->nr++;
+    return 0;
+}
+
+static int myfs_ext_cache_copy(struct myfs_extent *ext, void *data)
+{
+    struct myfs_ext_cache_fill *fill = data;
+
+    fill->extents[fill->nr++] = *ext;
+    return 0;
+}
+
+/*
+ * Load the extent cache of inode from its tree. On failure, the cache is
+ * dropped and a negative error code is returned.
+ */
+static int myfs_ext_cache_load(struct inode *inode)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+    struct myfs_ext_cache_fill fill = {NULL, 0};
+    uint32_t nr;
+    int ret;
+
+    ci->i_map_seq++;
+    ret = myfs_ext_walk(inode, myfs_ext_cache_count, &fill);
+    if (ret)
+        goto drop;
+    nr = fill.nr;
+    fill.nr = 0;
+    if (nr) {
+        fill.extents = kmalloc_array(nr, sizeof(struct myfs_extent), GFP_NOFS);
+        if (!fill.extents) {
+            ret = -ENOMEM;
+            goto drop;
+        }
+        ret = myfs_ext_walk(inode, myfs_ext_cache_copy, &fill);
+        if (ret) {
+            kfree(fill.extents);
+            goto drop;
+        }
+    }
+
+    kfree(ci->i_extents);
+    ci->i_extents = fill.extents;
+    ci->i_nr_extents = nr;
+    ci->i_max_extents = nr;
+    ci->i_extents_valid = true;
+    return 0;
+
+drop:
+    /* It is loaded again on next access */
+    myfs_ext_cache_drop(inode);
+    return ret;
+}
+
+/* Invalidate and free the extent cache of inode */
+void myfs_ext_cache_drop(struct inode *inode)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+
+    kfree(ci->i_extents);
+    ci->i_extents = NULL;
+    ci->i_nr_extents = 0;
+    ci->i_max_extents = 0;
+    ci->i_extents_valid = false;
+    ci->i_map_seq++;
+}
+
+/*
+ * Take i_map_sem for reading, loading the extent cache of inode if needed.
+ * Return 0 with the semaphore held, or a negative error code without it.
+ */
+int myfs_ext_cache_read_lock(struct inode *inode)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+
+    down_read(&ci->i_map_sem);
+    if (ci->i_extents_valid)
+        return 0;
+    up_read(&ci->i_map_sem);
+
+    down_write(&ci->i_map_sem);
+    if (!ci->i_extents_valid) {
+        int ret = myfs_ext_cache_load(inode);
+        if (ret) {
+            up_write(&ci->i_map_sem);
+            return ret;
+        }
+    }
+    downgrade_write(&ci->i_map_sem);
+
+    return 0;
+}
+
+/*
+ * Take i_map_sem for writing, loading the extent cache of inode if needed.
+ * Return 0 with the semaphore held, or a negative error code without it.
+ */
+int myfs_ext_cache_write_lock(struct inode *inode)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+
+    down_write(&ci->i_map_sem);
+    if (!ci->i_extents_valid) {
+        int ret = myfs_ext_cache_load(inode);
+        if (ret) {
+            up_write(&ci->i_map_sem);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Return the cached extent of inode containing iblock, or NULL if iblock is
+ * not mapped. i_map_sem must be held.
+ */
+struct myfs_extent *myfs_ext_cache_lookup(struct inode *inode, uint32_t iblock)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+    int i = myfs_ext_lookup(ci->i_extents, ci->i_nr_extents, iblock);
+
+    return i < 0 ? NULL : &ci->i_extents[i];
+}
+
+/*
+ * Return the first cached extent of inode starting after iblock, or NULL if
+ * there is none. i_map_sem must be held.
+ */
+struct myfs_extent *myfs_ext_cache_next(struct inode *inode, uint32_t iblock)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+    uint32_t lo = 0, hi = ci->i_nr_extents;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ci->i_extents[mid].ee_block <= iblock)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < ci->i_nr_extents ? &ci->i_extents[lo] : NULL;
+}
@@ -1,89 +1,914 @@
 #define pr_fmt(fmt) "myfs: " fmt
 
 #include <linux/buffer_head.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
+#include <linux/iomap.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
-#include <linux/mpage.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
 
 #include "bitmap.h"
 #include "myfs.h"
 
 /*
- * Map the buffer_head passed in argument with the iblock-th block of the file
- * represented by inode. If the requested block is not allocated and create is
- * true,  allocate a new block on disk and map it.
+ * File I/O goes through iomap: myfs_iomap_begin() maps a file range to whole
+ * extents, which drive buffered reads and writes, writeback and direct I/O.
+ * Pages carry no buffer_head.
+ *
+ * Delayed allocation: a buffered write only reserves space for the blocks it
+ * dirties in holes, and records them in the delayed ranges of the inode (an
+ * rbtree protected by i_map_sem), mapped as IOMAP_DELALLOC. Real blocks are
+ * allocated at writeback time by myfs_map_blocks(), for the whole delayed
+ * range at once. Reservations are accounted per inode and in
+ * sbi->dirty_blocks_counter, and are released when blocks get allocated or
+ * when delayed pages are thrown away.
+ *
+ * Unwritten extents: blocks get allocated unwritten by writeback and direct
+ * writes, and stay so until the write I/O has completed. Only then are they
+ * marked written, by myfs_end_io() for writeback and by the end_io handler of
+ * direct writes, so that a crash never exposes stale disk contents.
+ *
+ * Files are sparse: extents are keyed by logical block, and only the blocks
+ * which are written or preallocated get allocated. Holes read as zeroes
+ * without any I/O, and lseek() finds them with SEEK_HOLE and SEEK_DATA.
  */
-static int myfs_file_get_block(struct inode *inode,
-                                   sector_t iblock,
-                                   struct buffer_head *bh_result,
-                                   int create)
+
+/* Reserve nr blocks for delayed writes. Return 0 or -ENOSPC. */
+static int myfs_reserve_blocks(struct inode *inode, uint32_t nr)
 {
-    struct super_block *sb = inode->i_sb;
-    struct myfs_sb_info *sbi = MYFS_SB(sb);
+    struct myfs_sb_info *sbi = MYFS_SB(inode->i_sb);
     struct myfs_inode_info *ci = MYFS_INODE(inode);
-    struct myfs_file_ei_block *index;
-    struct buffer_head *bh_index;
-    bool alloc = false;
-    int ret = 0, bno;
-    uint32_t extent;
-
-    /* If block number exceeds filesize, fail */
-    if (iblock >= MYFS_MAX_BLOCKS_PER_EXTENT * MYFS_MAX_EXTENTS)
-        return -EFBIG;
+    s64 free = percpu_counter_read_positive(&sbi->free_blocks_counter);
+    s64 dirty = percpu_counter_read_positive(&sbi->dirty_blocks_counter);
 
-    /* Read directory block from disk */
-    bh_index = sb_bread(sb, ci->dir_block);
-    if (!bh_index)
-        return -EIO;
-    index = (struct myfs_file_ei_block *) bh_index->b_data;
+    /* Per-cpu counters are approximate, use the exact sums when it is close */
+    if (free - dirty < nr + 4 * percpu_counter_batch * nr_cpu_ids) {
+        free = percpu_counter_sum_positive(&sbi->free_blocks_counter);
+        dirty = percpu_counter_sum_positive(&sbi->dirty_blocks_counter);
+    }
+    if (free - dirty < nr)
+        return -ENOSPC;
+
+    percpu_counter_add(&sbi->dirty_blocks_counter, nr);
+    spin_lock(&ci->i_reserve_lock);
+    ci->i_reserved += nr;
+    spin_unlock(&ci->i_reserve_lock);
+
+    return 0;
+}
+
+/* Release up to nr blocks reserved by inode */
+static void myfs_release_blocks(struct inode *inode, uint32_t nr)
+{
+    struct myfs_sb_info *sbi = MYFS_SB(inode->i_sb);
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+
+    spin_lock(&ci->i_reserve_lock);
+    nr = min(nr, ci->i_reserved);
+    ci->i_reserved -= nr;
+    spin_unlock(&ci->i_reserve_lock);
 
-    extent = myfs_ext_search(index, iblock);
-    if (extent == -1) {
-        ret = -EFBIG;
-        goto brelse_index;
+    if (nr)
+        percpu_counter_sub(&sbi->dirty_blocks_counter, nr);
+}
+
+/* Range of delayed blocks, which are reserved but not allocated yet */
+struct myfs_delayed {
+    struct rb_node node;
+    uint32_t start; /* first logical block */
+    uint32_t len;   /* number of blocks */
+};
+
+/*
+ * Return the delayed range of inode containing iblock, or else the first one
+ * after it, or NULL. i_map_sem must be held.
+ */
+static struct myfs_delayed *myfs_da_lookup(struct inode *inode,
+                                           uint32_t iblock)
+{
+    struct rb_node *n = MYFS_INODE(inode)->i_delayed.rb_node;
+    struct myfs_delayed *next = NULL;
+
+    while (n) {
+        struct myfs_delayed *da = rb_entry(n, struct myfs_delayed, node);
+
+        if (iblock < da->start) {
+            next = da;
+            n = n->rb_left;
+        } else if (iblock >= da->start + da->len) {
+            n = n->rb_right;
+        } else {
+            return da;
+        }
     }
+    return next;
+}
 
-    /*
-     * Check if iblock is already allocated. If not and create is true,
-     * allocate it. Else, get the physical block number.
-     */
-    if (index->extents[extent].ee_start == 0) {
-        if (!create)
-            return 0;
-        bno = get_free_blocks(sbi, 8);
-        if (!bno) {
-            ret = -ENOSPC;
-            goto brelse_index;
+static void myfs_da_link(struct rb_root *root, struct myfs_delayed *new)
+{
+    struct rb_node **p = &root->rb_node, *parent = NULL;
+
+    while (*p) {
+        struct myfs_delayed *da = rb_entry(*p, struct myfs_delayed, node);
+
+        parent = *p;
+        if (new->start < da->start)
+            p = &(*p)->rb_left;
+        else
+            p = &(*p)->rb_right;
+    }
+    rb_link_node(&new->node, parent, p);
+    rb_insert_color(&new->node, root);
+}
+
+/*
+ * Add blocks [start, start + len), which must not be delayed yet, to the
+ * delayed ranges of inode, merging them with their neighbours.
+ * Return 0 or -ENOMEM. i_map_sem must be held for writing.
+ */
+static int myfs_da_insert(struct inode *inode, uint32_t start, uint32_t len)
+{
+    struct rb_root *root = &MYFS_INODE(inode)->i_delayed;
+    struct myfs_delayed *next = myfs_da_lookup(inode, start), *prev, *da;
+    struct rb_node *n = next ? rb_prev(&next->node) : rb_last(root);
+
+    prev = n ? rb_entry(n, struct myfs_delayed, node) : NULL;
+    if (prev && prev->start + prev->len == start) {
+        prev->len += len;
+        if (next && prev->start + prev->len == next->start) {
+            prev->len += next->len;
+            rb_erase(&next->node, root);
+            kfree(next);
+        }
+        return 0;
+    }
+    if (next && start + len == next->start) {
+        next->start = start;
+        next->len += len;
+        return 0;
+    }
+
+    da = kmalloc(sizeof(*da), GFP_NOFS);
+    if (!da)
+        return -ENOMEM;
+    da->start = start;
+    da->len = len;
+    myfs_da_link(root, da);
+
+    return 0;
+}
+
+/*
+ * Remove blocks [start, start + len) from the delayed ranges of inode and
+ * release their reservations. Return the number of delayed blocks removed.
+ * i_map_sem must be held for writing, unless the inode is being destroyed.
+ */
+uint32_t myfs_da_remove(struct inode *inode, uint32_t start, uint32_t len)
+{
+    struct rb_root *root = &MYFS_INODE(inode)->i_delayed;
+    struct myfs_delayed *da = myfs_da_lookup(inode, start);
+    uint64_t end = (uint64_t) start + len;
+    uint32_t nr = 0;
+
+    while (da && da->start < end) {
+        struct rb_node *next = rb_next(&da->node);
+        uint64_t da_end = (uint64_t) da->start + da->len;
+
+        if (da->start < start && da_end > end) {
+            /* Split the range around the removed blocks */
+            struct myfs_delayed *tail =
+                kmalloc(sizeof(*tail), GFP_NOFS | __GFP_NOFAIL);
+
+            tail->start = end;
+            tail->len = da_end - end;
+            da->len = start - da->start;
+            myfs_da_link(root, tail);
+            nr += len;
+            break;
+        }
+        if (da->start < start) {
+            nr += da_end - start;
+            da->len = start - da->start;
+        } else if (da_end > end) {
+            nr += end - da->start;
+            da->len = da_end - end;
+            da->start = end;
+        } else {
+            nr += da->len;
+            rb_erase(&da->node, root);
+            kfree(da);
+        }
+        da = next ? rb_entry(next, struct myfs_delayed, node) : NULL;
+    }
+
+    myfs_release_blocks(inode, nr);
+    return nr;
+}
+
+/*
+ * Allocate blocks [iblock, end) of inode, which must be a hole, as new extents
+ * with `flags`. The blocks are searched physically contiguous and right after
+ * the extent before iblock, falling back to smaller runs when space is
+ * fragmented, and are accounted in i_blocks. Allocated blocks are no longer
+ * delayed. Blocks of the file outside the range are left untouched, so other
+ * holes stay holes. i_map_sem must be held for writing, with the extent cache
+ * loaded.
+ */
+static int myfs_alloc_extents(struct inode *inode,
+                              uint32_t iblock,
+                              uint32_t end,
+                              uint16_t flags)
+{
+    struct myfs_sb_info *sbi = MYFS_SB(inode->i_sb);
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+    struct myfs_extent *next = myfs_ext_cache_next(inode, iblock), ext;
+    uint32_t prev = next ? next - ci->i_extents : ci->i_nr_extents;
+    uint32_t goal, len, bno;
+    int ret;
+
+    if (prev) {
+        ext = ci->i_extents[prev - 1];
+        if (iblock < ext.ee_block + ext.ee_len)
+            return -EIO;
+        goal = ext.ee_start + ext.ee_len;
+    } else {
+        goal = ci->ei_block + 1;
+    }
+
+    while (iblock < end) {
+        len = min_t(uint32_t, end - iblock, MYFS_MAX_BLOCKS_PER_EXTENT);
+
+        /* Fall back to smaller contiguous runs if needed */
+        for (;;) {
+            bno = get_free_blocks(sbi, goal, len);
+            if (bno)
+                break;
+            len /= 2;
+            if (!len)
+                return -ENOSPC;
+        }
+
+        ext.ee_block = iblock;
+        ext.ee_len = len;
+        ext.ee_flags = flags;
+        ext.ee_start = bno;
+        ret = myfs_ext_insert(inode, &ext);
+        if (ret) {
+            put_blocks(sbi, bno, len);
+            return ret;
         }
-        index->extents[extent].ee_start = bno;
-        index->extents[extent].ee_len = 8;
-        index->extents[extent].ee_block =
-            extent ? index->extents[extent - 1].ee_block +
-                         index->extents[extent - 1].ee_len
-                   : 0;
-        alloc = true;
+        inode->i_blocks += len;
+        mark_inode_dirty(inode);
+        myfs_da_remove(inode, iblock, len);
+
+        iblock += len;
+        goal = bno + len;
+    }
+
+    return 0;
+}
+
+/*
+ * Return the number of blocks of inode allocated from block `from`, which
+ * are about to be freed. i_map_sem must be held.
+ */
+static uint32_t myfs_count_blocks(struct inode *inode, uint32_t from)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+    struct myfs_extent *ext = myfs_ext_cache_lookup(inode, from);
+    uint32_t i, nr = 0;
+
+    if (ext) {
+        nr = ext->ee_block + ext->ee_len - from;
+        ext++;
     } else {
-        bno = index->extents[extent].ee_start + iblock -
-              index->extents[extent].ee_block;
+        ext = myfs_ext_cache_next(inode, from);
+        if (!ext)
+            return 0;
+    }
+    for (i = ext - ci->i_extents; i < ci->i_nr_extents; i++)
+        nr += ci->i_extents[i].ee_len;
+
+    return nr;
+}
+
+/* Map iomap to the whole extent ext */
+static void myfs_iomap_set_extent(struct inode *inode,
+                                  struct iomap *iomap,
+                                  const struct myfs_extent *ext)
+{
+    unsigned int blkbits = inode->i_blkbits;
+
+    iomap->type =
+        ext->ee_flags & MYFS_EXT_UNWRITTEN ? IOMAP_UNWRITTEN : IOMAP_MAPPED;
+    iomap->addr = (u64) ext->ee_start << blkbits;
+    iomap->offset = (loff_t) ext->ee_block << blkbits;
+    iomap->length = (u64) ext->ee_len << blkbits;
+}
+
+/* Map iomap to blocks [iblock, end), which are not allocated */
+static void myfs_iomap_set_hole(struct inode *inode,
+                                struct iomap *iomap,
+                                uint16_t type,
+                                uint32_t iblock,
+                                uint32_t end)
+{
+    unsigned int blkbits = inode->i_blkbits;
+
+    iomap->type = type;
+    iomap->addr = IOMAP_NULL_ADDR;
+    iomap->offset = (loff_t) iblock << blkbits;
+    iomap->length = (u64) (end - iblock) << blkbits;
+}
+
+/*
+ * Return the end of the hole of inode starting at iblock: the next extent,
+ * or end if it comes first. i_map_sem must be held.
+ */
+static uint32_t myfs_hole_end(struct inode *inode,
+                              uint32_t iblock,
+                              uint32_t end)
+{
+    struct myfs_extent *next = myfs_ext_cache_next(inode, iblock);
+
+    return next ? min(end, next->ee_block) : end;
+}
+
+/*
+ * Mark the unwritten blocks of inode in bytes [pos, pos + size) as written,
+ * after their write I/O has completed. If an extent cannot be split, it stays
+ * unwritten and the error is returned, to fail the write: its other blocks
+ * may be under I/O too, so they are never zeroed instead.
+ */
+static int myfs_convert_unwritten(struct inode *inode, loff_t pos, u64 size)
+{
+    struct rw_semaphore *sem = &MYFS_INODE(inode)->i_map_sem;
+    uint32_t iblock = pos >> inode->i_blkbits;
+    uint32_t end = DIV_ROUND_UP(pos + size, MYFS_BLOCK_SIZE);
+    int ret;
+
+    ret = myfs_ext_cache_write_lock(inode);
+    if (ret)
+        return ret;
+    while (iblock < end) {
+        struct myfs_extent *cached = myfs_ext_cache_lookup(inode, iblock), ext;
+        uint32_t len;
+
+        /* Nothing is left to convert where the blocks were freed meanwhile */
+        if (!cached) {
+            iblock = myfs_hole_end(inode, iblock, end);
+            continue;
+        }
+        ext = *cached;
+        len = min(end, ext.ee_block + ext.ee_len) - iblock;
+        if (ext.ee_flags & MYFS_EXT_UNWRITTEN) {
+            ret = myfs_ext_set_flags(inode, iblock, len,
+                                     ext.ee_flags & ~MYFS_EXT_UNWRITTEN);
+            if (ret)
+                break;
+        }
+        iblock += len;
+    }
+    up_write(sem);
+
+    return ret;
+}
+
+/*
+ * Map iomap to the blocks of inode from iblock, without changing anything:
+ * the whole extent containing iblock, or else the delayed range or the hole
+ * it starts. i_map_sem must be held.
+ */
+static void myfs_iomap_lookup(struct inode *inode,
+                              uint32_t iblock,
+                              struct iomap *iomap)
+{
+    struct myfs_extent *ext = myfs_ext_cache_lookup(inode, iblock);
+    struct myfs_delayed *da;
+    uint32_t end;
+
+    if (ext) {
+        myfs_iomap_set_extent(inode, iomap, ext);
+        return;
+    }
+
+    end = myfs_hole_end(inode, iblock, MYFS_MAX_FILESIZE / MYFS_BLOCK_SIZE);
+    da = myfs_da_lookup(inode, iblock);
+    if (da && da->start <= iblock)
+        myfs_iomap_set_hole(inode, iomap, IOMAP_DELALLOC, iblock,
+                            min(end, da->start + da->len));
+    else
+        myfs_iomap_set_hole(inode, iomap, IOMAP_HOLE, iblock,
+                            da ? min(end, da->start) : end);
+}
+
+/*
+ * Map blocks [iblock, end) of inode for a buffered write. Blocks which are
+ * neither allocated nor delayed are reserved and become delayed, the range
+ * being flagged IOMAP_F_NEW. Less than the whole range is reserved if space
+ * is short. i_map_sem must be held for writing.
+ */
+static int myfs_iomap_buffered_write(struct inode *inode,
+                                     uint32_t iblock,
+                                     uint32_t end,
+                                     struct iomap *iomap)
+{
+    uint32_t len;
+    int ret;
+
+    myfs_iomap_lookup(inode, iblock, iomap);
+    if (iomap->type != IOMAP_HOLE)
+        return 0;
+
+    len = min_t(u64, end - iblock, iomap->length >> inode->i_blkbits);
+    while ((ret = myfs_reserve_blocks(inode, len)) == -ENOSPC && len > 1)
+        len /= 2;
+    if (ret)
+        return ret;
+    ret = myfs_da_insert(inode, iblock, len);
+    if (ret) {
+        myfs_release_blocks(inode, len);
+        return ret;
+    }
+
+    myfs_iomap_set_hole(inode, iomap, IOMAP_DELALLOC, iblock, iblock + len);
+    iomap->flags |= IOMAP_F_NEW;
+    return 0;
+}
+
+/*
+ * Map blocks [iblock, end) of inode for a direct write. Holes are allocated
+ * as unwritten extents, the whole range at once. Unwritten blocks are mapped
+ * as such, iomap zeroes their partial blocks and the end_io handler marks
+ * them written. i_map_sem must be held for writing.
+ */
+static int myfs_iomap_direct_write(struct inode *inode,
+                                   uint32_t iblock,
+                                   uint32_t end,
+                                   struct iomap *iomap)
+{
+    struct myfs_extent *ext = myfs_ext_cache_lookup(inode, iblock);
+    int ret;
+
+    if (!ext) {
+        /* The page cache of the range was written back, nothing is delayed */
+        end = myfs_hole_end(inode, iblock, end);
+        ret = myfs_alloc_extents(inode, iblock, end, MYFS_EXT_UNWRITTEN);
+        if (ret)
+            return ret;
+        ext = myfs_ext_cache_lookup(inode, iblock);
+        if (!ext)
+            return -EIO;
+    }
+
+    myfs_iomap_set_extent(inode, iomap, ext);
+    return 0;
+}
+
+/*
+ * Called by iomap to map [pos, pos + length) of inode. The mapping returned
+ * may start before pos and go past the range, up to a whole extent. Writes
+ * reserve (buffered) or allocate (direct) the blocks they need, other
+ * operations only look up the extents.
+ */
+static int myfs_iomap_begin(struct inode *inode,
+                            loff_t pos,
+                            loff_t length,
+                            unsigned int flags,
+                            struct iomap *iomap,
+                            struct iomap *srcmap)
+{
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+    uint32_t iblock = pos >> inode->i_blkbits, end;
+    int ret;
+
+    iomap->bdev = inode->i_sb->s_bdev;
+
+    /* Only FIEMAP maps inline data, reads and writes go through the page */
+    if (myfs_has_inline_data(inode)) {
+        if (!(flags & IOMAP_REPORT))
+            return -ENOTBLK;
+        iomap->type = IOMAP_INLINE;
+        iomap->addr = IOMAP_NULL_ADDR;
+        iomap->offset = 0;
+        iomap->length = i_size_read(inode);
+        if (pos >= iomap->length)
+            myfs_iomap_set_hole(inode, iomap, IOMAP_HOLE, iblock,
+                                MYFS_MAX_FILESIZE / MYFS_BLOCK_SIZE);
+        return 0;
+    }
+
+    if (pos >= MYFS_MAX_FILESIZE)
+        return -EFBIG;
+
+    if (!(flags & IOMAP_WRITE)) {
+        ret = myfs_ext_cache_read_lock(inode);
+        if (ret)
+            return ret;
+        myfs_iomap_lookup(inode, iblock, iomap);
+        up_read(&ci->i_map_sem);
+        return 0;
+    }
+
+    end = DIV_ROUND_UP(min_t(u64, pos + length, MYFS_MAX_FILESIZE),
+                       MYFS_BLOCK_SIZE);
+    ret = myfs_ext_cache_write_lock(inode);
+    if (ret)
+        return ret;
+    if (flags & IOMAP_DIRECT)
+        ret = myfs_iomap_direct_write(inode, iblock, end, iomap);
+    else
+        ret = myfs_iomap_buffered_write(inode, iblock, end, iomap);
+    up_write(&ci->i_map_sem);
+
+    return ret;
+}
+
+/*
+ * Called by iomap after a write to [pos, pos + length). Blocks reserved by
+ * myfs_iomap_begin() for a buffered write but not written are dropped from
+ * the page cache and released.
+ */
+static int myfs_iomap_end(struct inode *inode,
+                          loff_t pos,
+                          loff_t length,
+                          ssize_t written,
+                          unsigned int flags,
+                          struct iomap *iomap)
+{
+    struct rw_semaphore *sem = &MYFS_INODE(inode)->i_map_sem;
+    uint32_t start, end;
+
+    if (iomap->type != IOMAP_DELALLOC || !(iomap->flags & IOMAP_F_NEW))
+        return 0;
+
+    /* If nothing was written, the block of pos was not either */
+    if (written)
+        start = DIV_ROUND_UP(pos + written, MYFS_BLOCK_SIZE);
+    else
+        start = pos >> inode->i_blkbits;
+    end = DIV_ROUND_UP(pos + length, MYFS_BLOCK_SIZE);
+    if (start >= end)
+        return 0;
+
+    truncate_pagecache_range(inode, (loff_t) start << inode->i_blkbits,
+                             ((loff_t) end << inode->i_blkbits) - 1);
+    down_write(sem);
+    myfs_da_remove(inode, start, end - start);
+    up_write(sem);
+
+    return 0;
+}
+
+static const struct iomap_ops myfs_iomap_ops = {
+    .iomap_begin = myfs_iomap_begin,
+    .iomap_end = myfs_iomap_end,
+};
+
+/*
+ * Writeback context: the mapping used for the previous page is reused for the
+ * next ones as long as the extents did not change (i_map_seq).
+ */
+struct myfs_writepage_ctx {
+    struct iomap_writepage_ctx ctx;
+    unsigned int seq;
+};
+
+/*
+ * Called by iomap writeback to map the block of inode at offset. Delayed
+ * blocks are allocated with the rest of their delayed range, as unwritten
+ * extents. Unwritten blocks are mapped as such: they are only marked written
+ * by myfs_end_io(), once their I/O has completed.
+ */
+static int myfs_map_blocks(struct iomap_writepage_ctx *wpc,
+                           struct inode *inode,
+                           loff_t offset)
+{
+    struct myfs_writepage_ctx *ctx =
+        container_of(wpc, struct myfs_writepage_ctx, ctx);
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+    uint32_t iblock = offset >> inode->i_blkbits;
+    struct myfs_extent *ext;
+    int ret = 0;
+
+    if (offset >= wpc->iomap.offset &&
+        offset < wpc->iomap.offset + wpc->iomap.length &&
+        ctx->seq == READ_ONCE(ci->i_map_seq))
+        return 0;
+
+    /* Allocated blocks only need the extent cache */
+    ret = myfs_ext_cache_read_lock(inode);
+    if (ret)
+        return ret;
+    ext = myfs_ext_cache_lookup(inode, iblock);
+    if (ext) {
+        myfs_iomap_set_extent(inode, &wpc->iomap, ext);
+        ctx->seq = ci->i_map_seq;
+        up_read(&ci->i_map_sem);
+        return 0;
+    }
+    up_read(&ci->i_map_sem);
+
+    ret = myfs_ext_cache_write_lock(inode);
+    if (ret)
+        return ret;
+    myfs_iomap_lookup(inode, iblock, &wpc->iomap);
+    /* Holes are skipped, allocated blocks were raced with */
+    if (wpc->iomap.type == IOMAP_DELALLOC) {
+        ret = myfs_alloc_extents(
+            inode, iblock,
+            (wpc->iomap.offset + wpc->iomap.length) >> inode->i_blkbits,
+            MYFS_EXT_UNWRITTEN);
+        if (!ret)
+            myfs_iomap_lookup(inode, iblock, &wpc->iomap);
+    }
+    ctx->seq = ci->i_map_seq;
+    up_write(&ci->i_map_sem);
+
+    return ret;
+}
+
+/*
+ * Called by iomap writeback when the blocks of page from fileoff could not be
+ * mapped. The page is thrown away, so release its delayed blocks.
+ */
+static void myfs_discard_page(struct page *page, loff_t fileoff)
+{
+    struct inode *inode = page->mapping->host;
+    struct rw_semaphore *sem = &MYFS_INODE(inode)->i_map_sem;
+    loff_t end = page_offset(page) + PAGE_SIZE;
+
+    down_write(sem);
+    myfs_da_remove(inode, fileoff >> inode->i_blkbits,
+                   (end - fileoff) >> inode->i_blkbits);
+    up_write(sem);
+}
+
+/* Mark the blocks written by ioend written, then end its page writeback */
+static void myfs_end_ioend(struct iomap_ioend *ioend)
+{
+    struct inode *inode = ioend->io_inode;
+    unsigned int nofs_flag = memalloc_nofs_save();
+    int ret = blk_status_to_errno(ioend->io_bio->bi_status);
+
+    if (!ret) {
+        ret = myfs_convert_unwritten(inode, ioend->io_offset, ioend->io_size);
+        if (ret)
+            pr_err("failed converting unwritten extents of inode %lu\n",
+                   inode->i_ino);
+    }
+    iomap_finish_ioends(ioend, ret);
+    memalloc_nofs_restore(nofs_flag);
+}
+
+/*
+ * Work completing the writeback ioends of an inode to unwritten extents. The
+ * ioends are sorted and contiguous ones merged, to convert them at once.
+ */
+void myfs_end_io(struct work_struct *work)
+{
+    struct myfs_inode_info *ci =
+        container_of(work, struct myfs_inode_info, i_ioend_work);
+    struct iomap_ioend *ioend;
+    struct list_head list;
+    unsigned long flags;
+
+    spin_lock_irqsave(&ci->i_ioend_lock, flags);
+    list_replace_init(&ci->i_ioend_list, &list);
+    spin_unlock_irqrestore(&ci->i_ioend_lock, flags);
+
+    iomap_sort_ioends(&list);
+    while ((ioend = list_first_entry_or_null(&list, struct iomap_ioend,
+                                             io_list))) {
+        list_del_init(&ioend->io_list);
+        iomap_ioend_try_merge(ioend, &list, NULL);
+        myfs_end_ioend(ioend);
+    }
+}
+
+/*
+ * Completion of a writeback bio to unwritten extents, in interrupt context:
+ * queue its ioend to be completed by myfs_end_io().
+ */
+static void myfs_end_bio(struct bio *bio)
+{
+    struct iomap_ioend *ioend = bio->bi_private;
+    struct inode *inode = ioend->io_inode;
+    struct myfs_sb_info *sbi = MYFS_SB(inode->i_sb);
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+    unsigned long flags;
+
+    spin_lock_irqsave(&ci->i_ioend_lock, flags);
+    if (list_empty(&ci->i_ioend_list))
+        WARN_ON_ONCE(!queue_work(sbi->unwritten_wq, &ci->i_ioend_work));
+    list_add_tail(&ioend->io_list, &ci->i_ioend_list);
+    spin_unlock_irqrestore(&ci->i_ioend_lock, flags);
+}
+
+/*
+ * Called by iomap writeback before submitting ioend. Writes to unwritten
+ * extents complete through myfs_end_bio(), others end right away.
+ */
+static int myfs_prepare_ioend(struct iomap_ioend *ioend, int status)
+{
+    if (!status && ioend->io_type == IOMAP_UNWRITTEN)
+        ioend->io_bio->bi_end_io = myfs_end_bio;
+    return status;
+}
+
+static const struct iomap_writeback_ops myfs_writeback_ops = {
+    .map_blocks = myfs_map_blocks,
+    .prepare_ioend = myfs_prepare_ioend,
+    .discard_page = myfs_discard_page,
+};
+
+/*
+ * Inline data: a new regular file stores its data in the i_data area of its
+ * inode (MYFS_INODE_INLINE) and has no block at all. Its only page is filled
+ * from i_data and copied back to it by write_end(), outside of iomap, so it
+ * never needs to be written back. The data moves to a delayed block and the
+ * file gets an extent tree once a write goes beyond MYFS_INLINE_DATA_SIZE.
+ */
+
+/* Fill page of an inline file from i_data and mark it uptodate */
+static void myfs_inline_read_page(struct inode *inode, struct page *page)
+{
+    size_t size = 0;
+    void *kaddr;
+
+    if (!page->index)
+        size = min_t(loff_t, i_size_read(inode), MYFS_INLINE_DATA_SIZE);
+
+    kaddr = kmap_atomic(page);
+    memcpy(kaddr, MYFS_INODE(inode)->i_data, size);
+    memset(kaddr + size, 0, PAGE_SIZE - size);
+    kunmap_atomic(kaddr);
+    flush_dcache_page(page);
+    SetPageUptodate(page);
+}
+
+/*
+ * Move the data of an inline file to a delayed block of its page and create
+ * an empty extent tree. Called with the inode locked.
+ */
+static int myfs_inline_convert(struct inode *inode, unsigned int flags)
+{
+    struct super_block *sb = inode->i_sb;
+    struct myfs_inode_info *ci = MYFS_INODE(inode);
+    loff_t size = i_size_read(inode);
+    struct page *page = NULL;
+    struct buffer_head *bh;
+    uint32_t bno;
+    int ret = 0;
+
+    /* Allocate the root of the extent tree, an empty leaf */
+    bno = get_free_blocks(MYFS_SB(sb), 0, 1);
+    if (!bno)
+        return -ENOSPC;
+    bh = sb_getblk(sb, bno);
+    if (!bh) {
+        ret = -EIO;
+        goto put_block;
     }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, MYFS_BLOCK_SIZE);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    brelse(bh);
 
-    /* Map the physical block to to the given buffer_head */
-    map_bh(bh_result, sb, bno);
+    if (size) {
+        page = grab_cache_page_write_begin(inode->i_mapping, 0, flags);
+        if (!page) {
+            ret = -ENOMEM;
+            goto put_block;
+        }
+        if (!PageUptodate(page))
+            myfs_inline_read_page(inode, page);
+        ret = myfs_reserve_blocks(inode, 1);
+        if (ret)
+            goto put_page;
+    }
 
-brelse_index:
-    brelse(bh_index);
+    down_write(&ci->i_map_sem);
+    if (page) {
+        ret = myfs_da_insert(inode, 0, 1);
+        if (ret) {
+            up_write(&ci->i_map_sem);
+            myfs_release_blocks(inode, 1);
+            goto put_page;
+        }
+    }
+    ci->ei_block = bno;
+    ci->i_flags &= ~MYFS_INODE_INLINE;
+    memset(ci->i_data, 0, sizeof(ci->i_data));
+    up_write(&ci->i_map_sem);
 
+    /* The data is now written back from the page, like any other */
+    if (page) {
+        set_page_dirty(page);
+        unlock_page(page);
+        put_page(page);
+    }
+
+    /* Only the root is allocated, data blocks are counted as they get theirs */
+    inode->i_blocks = 1;
+    mark_inode_dirty(inode);
+    return 0;
+
+put_page:
+    unlock_page(page);
+    put_page(page);
+put_block:
+    put_blocks(MYFS_SB(sb), bno, 1);
     return ret;
 }
 
+/*
+ * Called by generic_perform_write() for writes to inline files, which stay
+ * within MYFS_INLINE_DATA_SIZE: the bytes are written to the page, then
+ * copied to the inode by write_end().
+ */
+static int myfs_write_begin(struct file *file,
+                            struct address_space *mapping,
+                            loff_t pos,
+                            unsigned int len,
+                            unsigned int flags,
+                            struct page **pagep,
+                            void **fsdata)
+{
+    struct inode *inode = mapping->host;
+    struct page *page;
+
+    if (WARN_ON(!myfs_has_inline_data(inode) ||
+                pos + len > MYFS_INLINE_DATA_SIZE))
+        return -EIO;
+
+    page = grab_cache_page_write_begin(mapping, 0, flags);
+    if (!page)
+        return -ENOMEM;
+    if (!PageUptodate(page))
+        myfs_inline_read_page(inode, page);
+    *pagep = page;
+
+    return 0;
+}
+
+/* write_end() of inline files: copy the written bytes to the inode */
+static int myfs_write_end(struct file *file,
+                          struct address_space *mapping,
+                          loff_t pos,
+                          unsigned int len,
+                          unsigned int copied,
+                          struct page *page,
+                          void *fsdata)
+{
+    struct inode *inode = mapping->host;
+    void *kaddr = kmap_atomic(page);
+
+    memcpy(MYFS_INODE(inode)->i_data + pos, kaddr + pos, copied);
+    kunmap_atomic(kaddr);
+    if (pos + copied > inode->i_size)
+        i_size_write(inode, pos + copied);
+    unlock_page(page);
+    put_page(page);
+
+    inode->i_mtime = inode->i_ctime = current_time(inode);
+    mark_inode_dirty(inode);
+
+    return copied;
+}
+
 /*
  * Called by the page cache to read a page from the physical disk and map it in
  * memory.
  */
 static int myfs_readpage(struct file *file, struct page *page)
 {
-    return mpage_readpage(page, myfs_file_get_block);
+    struct inode *inode = page->mapping->host;
+
+    if (myfs_has_inline_data(inode)) {
+        myfs_inline_read_page(inode, page);
+        unlock_page(page);
+        return 0;
+    }
+    return iomap_readpage(page, &myfs_iomap_ops);
+}
+
+/*
+ * Called by the page cache to read the pages of a readahead window. Each
+ * extent is mapped with a single call, and iomap submits one bio per
+ * physically contiguous run of pages.
+ */
+static void myfs_readahead(struct readahead_control *rac)
+{
+    /* The only page of an inline file is left to readpage() */
+    if (myfs_has_inline_data(rac->mapping->host))
+        return;
+    iomap_readahead(rac, &myfs_iomap_ops);
 }
 
 /*
@@ -92,128 +917,496 @@ static int myfs_readpage(struct file *file, struct page *page)
  */
 static int myfs_writepage(struct page *page, struct writeback_control *wbc)
 {
-    return block_write_full_page(page, myfs_file_get_block, wbc);
+    struct myfs_writepage_ctx ctx = {};
+
+    /* Inline data was already copied to the inode by write_end() */
+    if (myfs_has_inline_data(page->mapping->host)) {
+        unlock_page(page);
+        return 0;
+    }
+    return iomap_writepage(page, wbc, &ctx.ctx, &myfs_writeback_ops);
 }
 
 /*
- * Called by the VFS when a write() syscall occurs on file before writing the
- * data in the page cache. This functions checks if the write will be able to
- * complete and allocates the necessary blocks through block_write_begin().
+ * Called by the page cache to write back the dirty pages of a file. Pages are
+ * walked in order and added to the same bio while their blocks are
+ * physically contiguous.
  */
-static int myfs_write_begin(struct file *file,
-                                struct address_space *mapping,
-                                loff_t pos,
-                                unsigned int len,
-                                unsigned int flags,
-                                struct page **pagep,
-                                void **fsdata)
-{
-    struct myfs_sb_info *sbi = MYFS_SB(file->f_inode->i_sb);
-    int err;
-    uint32_t nr_allocs = 0;
-
-    /* Check if the write can be completed (enough space?) */
-    if (pos + len > MYFS_MAX_FILESIZE)
-        return -ENOSPC;
-    nr_allocs = max(pos + len, file->f_inode->i_size) / MYFS_BLOCK_SIZE;
-    if (nr_allocs > file->f_inode->i_blocks - 1)
-        nr_allocs -= file->f_inode->i_blocks - 1;
-    else
-        nr_allocs = 0;
-    if (nr_allocs > sbi->nr_free_blocks)
-        return -ENOSPC;
+static int myfs_writepages(struct address_space *mapping,
+                           struct writeback_control *wbc)
+{
+    struct myfs_writepage_ctx ctx = {};
 
-    /* prepare the write */
-    err = block_write_begin(mapping, pos, len, flags, pagep,
-                            myfs_file_get_block);
-    /* if this failed, reclaim newly allocated blocks */
-    if (err < 0)
-        pr_err("newly allocated blocks reclaim not implemented yet\n");
-    return err;
+    if (myfs_has_inline_data(mapping->host))
+        return 0;
+    return iomap_writepages(mapping, wbc, &ctx.ctx, &myfs_writeback_ops);
 }
 
 /*
- * Called by the VFS after writing data from a write() syscall to the page
- * cache. This functions updates inode metadata and truncates the file if
- * necessary.
+ * Called by the VFS for the read() family of syscalls. Direct reads build
+ * bios straight from the user buffers, except for inline files which are
+ * read from the page cache.
  */
-static int myfs_write_end(struct file *file,
-                              struct address_space *mapping,
-                              loff_t pos,
-                              unsigned int len,
-                              unsigned int copied,
-                              struct page *page,
-                              void *fsdata)
-{
-    struct inode *inode = file->f_inode;
+static ssize_t myfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    if (!(iocb->ki_flags & IOCB_DIRECT))
+        return generic_file_read_iter(iocb, to);
+    if (!iov_iter_count(to))
+        return 0;
+
+    inode_lock_shared(inode);
+    if (myfs_has_inline_data(inode)) {
+        inode_unlock_shared(inode);
+        iocb->ki_flags &= ~IOCB_DIRECT;
+        return generic_file_read_iter(iocb, to);
+    }
+    ret = iomap_dio_rw(iocb, to, &myfs_iomap_ops, NULL, is_sync_kiocb(iocb));
+    inode_unlock_shared(inode);
+    file_accessed(iocb->ki_filp);
+
+    return ret;
+}
+
+/*
+ * Completion of a direct write of size bytes: mark the unwritten blocks
+ * written and extend the file by what was written. Writes extending the file
+ * are synchronous, so the inode is still locked.
+ */
+static int myfs_dio_write_end_io(struct kiocb *iocb,
+                                 ssize_t size,
+                                 int error,
+                                 unsigned int flags)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    int ret;
+
+    if (error)
+        return error;
+    if (size && (flags & IOMAP_DIO_UNWRITTEN)) {
+        ret = myfs_convert_unwritten(inode, iocb->ki_pos, size);
+        if (ret)
+            return ret;
+    }
+    if (size && iocb->ki_pos + size > i_size_read(inode)) {
+        i_size_write(inode, iocb->ki_pos + size);
+        mark_inode_dirty(inode);
+    }
+    return 0;
+}
+
+static const struct iomap_dio_ops myfs_dio_write_ops = {
+    .end_io = myfs_dio_write_end_io,
+};
+
+/* Free the blocks of inode from block `from`, past the end of file */
+static void myfs_trim_blocks(struct inode *inode, uint32_t from)
+{
+    struct rw_semaphore *sem = &MYFS_INODE(inode)->i_map_sem;
+    int ret;
+
+    ret = myfs_ext_cache_write_lock(inode);
+    if (!ret) {
+        inode->i_blocks -= myfs_count_blocks(inode, from);
+        mark_inode_dirty(inode);
+        ret = myfs_ext_truncate(inode, from, false);
+        up_write(sem);
+    }
+    if (ret)
+        pr_err("failed truncating inode %lu, we just lost some blocks\n",
+               inode->i_ino);
+}
+
+/*
+ * Direct write, called with the inode locked. Bios are built straight from
+ * the user buffer, and appending writes allocate the blocks of the whole
+ * range at once. Blocks allocated past what a failed or short write covered
+ * are freed again, keeping the preallocated ones. What could not be written
+ * directly, if the page cache could not be invalidated, is written through
+ * it.
+ */
+static ssize_t myfs_dio_write(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct address_space *mapping = inode->i_mapping;
+    loff_t end = iocb->ki_pos + iov_iter_count(from);
+    bool extend = end > i_size_read(inode);
+    struct myfs_extent ext = {0};
+    uint32_t last;
+    ssize_t ret;
+
+    /* End of the allocated blocks, to undo the allocations of a failure */
+    if (extend) {
+        down_read(&MYFS_INODE(inode)->i_map_sem);
+        ret = myfs_ext_find(inode, U32_MAX, &ext);
+        up_read(&MYFS_INODE(inode)->i_map_sem);
+        if (ret < 0)
+            return ret;
+    }
+    last = ext.ee_block + ext.ee_len;
+
+    ret = iomap_dio_rw(iocb, from, &myfs_iomap_ops, &myfs_dio_write_ops,
+                       is_sync_kiocb(iocb) || extend);
+    if (ret == -ENOTBLK)
+        ret = 0;
+    if (extend && iocb->ki_pos < end)
+        myfs_trim_blocks(
+            inode, max_t(uint32_t, last, DIV_ROUND_UP(i_size_read(inode),
+                                                      MYFS_BLOCK_SIZE)));
+
+    if (ret >= 0 && iov_iter_count(from)) {
+        loff_t pos = iocb->ki_pos;
+        ssize_t done = iomap_file_buffered_write(iocb, from, &myfs_iomap_ops);
+        int err;
+
+        if (done <= 0)
+            return ret ? ret : done;
+        iocb->ki_pos += done;
+        ret += done;
+        err = filemap_write_and_wait_range(mapping, pos, pos + done - 1);
+        if (!err)
+            invalidate_mapping_pages(mapping, pos >> PAGE_SHIFT,
+                                     (pos + done - 1) >> PAGE_SHIFT);
+    }
+
+    return ret;
+}
+
+/*
+ * Called by the VFS for the write() family of syscalls. Inline files are
+ * written through write_begin() and write_end() while they fit in the inode,
+ * other files through iomap, either buffered or direct.
+ */
+static ssize_t myfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file_inode(file);
+    ssize_t ret;
+
+    inode_lock(inode);
+    ret = generic_write_checks(iocb, from);
+    if (ret <= 0)
+        goto unlock;
+    ret = file_remove_privs(file);
+    if (ret)
+        goto unlock;
+    ret = file_update_time(file);
+    if (ret)
+        goto unlock;
+
+    if (myfs_has_inline_data(inode) &&
+        iocb->ki_pos + iov_iter_count(from) > MYFS_INLINE_DATA_SIZE) {
+        ret = myfs_inline_convert(inode, 0);
+        if (ret)
+            goto unlock;
+    }
+
+    current->backing_dev_info = inode_to_bdi(inode);
+    if (myfs_has_inline_data(inode)) {
+        ret = generic_perform_write(file, from, iocb->ki_pos);
+        if (ret > 0)
+            iocb->ki_pos += ret;
+    } else {
+        if (iocb->ki_flags & IOCB_DIRECT) {
+            ret = myfs_dio_write(iocb, from);
+        } else {
+            ret = iomap_file_buffered_write(iocb, from, &myfs_iomap_ops);
+            if (ret > 0)
+                iocb->ki_pos += ret;
+        }
+    }
+    current->backing_dev_info = NULL;
+
+unlock:
+    inode_unlock(inode);
+    if (ret > 0)
+        ret = generic_write_sync(iocb, ret);
+    return ret;
+}
+
+/*
+ * Change the size of regular file inode, for truncate() and open(O_TRUNC).
+ * The blocks past the new end of file are freed, delayed and preallocated
+ * ones included. Called with the inode locked.
+ */
+int myfs_truncate(struct inode *inode, loff_t size)
+{
     struct myfs_inode_info *ci = MYFS_INODE(inode);
-    struct super_block *sb = inode->i_sb;
-    uint32_t nr_blocks_old;
+    uint32_t from = DIV_ROUND_UP(size, MYFS_BLOCK_SIZE);
+    int ret;
+
+    inode_dio_wait(inode);
 
-    /* Complete the write() */
-    int ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
-    if (ret < len) {
-        pr_err("wrote less than requested.");
+    if (myfs_has_inline_data(inode)) {
+        if (size <= MYFS_INLINE_DATA_SIZE) {
+            /* What is cut must read as zeroes if the file grows again */
+            if (size < inode->i_size)
+                memset(ci->i_data + size, 0, MYFS_INLINE_DATA_SIZE - size);
+            truncate_setsize(inode, size);
+            return 0;
+        }
+        ret = myfs_inline_convert(inode, 0);
+        if (ret)
+            return ret;
+    }
+
+    if (size < inode->i_size) {
+        /* The last block stays allocated, zero its end */
+        ret = iomap_truncate_page(inode, size, NULL, &myfs_iomap_ops);
+        if (ret)
+            return ret;
+        truncate_setsize(inode, size);
+
+        ret = myfs_ext_cache_write_lock(inode);
+        if (ret)
+            return ret;
+        myfs_da_remove(inode, from, U32_MAX - from);
+        inode->i_blocks -= myfs_count_blocks(inode, from);
+        ret = myfs_ext_truncate(inode, from, false);
+        up_write(&ci->i_map_sem);
+        if (ret)
+            return ret;
+    } else {
+        /* Growing the file leaves a hole, nothing is allocated */
+        truncate_setsize(inode, size);
+    }
+
+    return 0;
+}
+
+/*
+ * Preallocate the holes of inode in blocks [iblock, end) as unwritten
+ * extents. Blocks that are already allocated are left untouched.
+ */
+static int myfs_prealloc(struct inode *inode, uint32_t iblock, uint32_t end)
+{
+    struct rw_semaphore *sem = &MYFS_INODE(inode)->i_map_sem;
+    int ret;
+
+    ret = myfs_ext_cache_write_lock(inode);
+    if (ret)
         return ret;
+    while (iblock < end) {
+        struct myfs_extent *ext = myfs_ext_cache_lookup(inode, iblock);
+        uint32_t hole_end;
+
+        if (ext) {
+            iblock = ext->ee_block + ext->ee_len;
+            continue;
+        }
+        hole_end = myfs_hole_end(inode, iblock, end);
+        ret = myfs_alloc_extents(inode, iblock, hole_end, MYFS_EXT_UNWRITTEN);
+        if (ret)
+            break;
+        iblock = hole_end;
     }
+    up_write(sem);
 
-    nr_blocks_old = inode->i_blocks;
+    return ret;
+}
 
-    /* Update inode metadata */
-    inode->i_blocks = inode->i_size / MYFS_BLOCK_SIZE + 2;
-    inode->i_mtime = inode->i_ctime = current_time(inode);
-    mark_inode_dirty(inode);
+/* Write zeroes to bytes [from, to) of file through the page cache */
+static int myfs_zero_partial(struct file *file, loff_t from, loff_t to)
+{
+    struct inode *inode = file_inode(file);
+
+    /* Never extend the file */
+    to = min(to, i_size_read(inode));
+    if (from >= to)
+        return 0;
+
+    return iomap_zero_range(inode, from, to - from, NULL, &myfs_iomap_ops);
+}
+
+/*
+ * Punch a hole in bytes [start, end) of file. Partial blocks are zeroed
+ * through the page cache. Whole blocks are dropped from the page cache,
+ * removed from the extents and freed, and are no longer counted in i_blocks.
+ */
+static int myfs_punch_hole(struct file *file, loff_t start, loff_t end)
+{
+    struct inode *inode = file_inode(file);
+    loff_t first_full = round_up(start, MYFS_BLOCK_SIZE);
+    loff_t last_full = round_down(end, MYFS_BLOCK_SIZE);
+    uint32_t iblock, last;
+    int ret;
+
+    /* Hole inside a single block */
+    if (first_full > last_full)
+        return myfs_zero_partial(file, start, end);
+
+    ret = myfs_zero_partial(file, start, first_full);
+    if (!ret)
+        ret = myfs_zero_partial(file, last_full, end);
+    if (ret || first_full == last_full)
+        return ret;
+
+    truncate_pagecache_range(inode, first_full, last_full - 1);
 
-    /* If file is smaller than before, free unused blocks */
-    if (nr_blocks_old > inode->i_blocks) {
-        int i;
-        struct buffer_head *bh_index;
-        struct myfs_file_ei_block *index;
-        uint32_t first_ext;
-
-        /* Free unused blocks from page cache */
-        truncate_pagecache(inode, inode->i_size);
-
-        /* Read ei_block to remove unused blocks */
-        bh_index = sb_bread(sb, ci->ei_block);
-        if (!bh_index) {
-            pr_err("failed truncating '%s'. we just lost %llu blocks\n",
-                   file->f_path.dentry->d_name.name,
-                   nr_blocks_old - inode->i_blocks);
-            goto end;
+    ret = myfs_ext_cache_write_lock(inode);
+    if (ret)
+        return ret;
+    iblock = first_full / MYFS_BLOCK_SIZE;
+    last = last_full / MYFS_BLOCK_SIZE;
+    myfs_da_remove(inode, iblock, last - iblock);
+    while (iblock < last) {
+        struct myfs_extent *cached = myfs_ext_cache_lookup(inode, iblock), ext;
+        uint32_t len;
+
+        /* Holes are already what we want */
+        if (!cached) {
+            iblock = myfs_hole_end(inode, iblock, last);
+            continue;
         }
-        index = (struct myfs_file_ei_block *) bh_index->b_data;
+        ext = *cached;
+        len = min(last, ext.ee_block + ext.ee_len) - iblock;
+
+        ret = myfs_ext_remove_blocks(inode, iblock, len);
+        if (ret)
+            break;
+        inode->i_blocks -= len;
+        mark_inode_dirty(inode);
+        iblock += len;
+    }
 
-        first_ext = myfs_ext_search(index, inode->i_blocks - 1);
-        /* Reserve unused block in last extent */
-        if (inode->i_blocks - 1 != index->extents[first_ext].ee_block)
-            first_ext++;
+    up_write(&MYFS_INODE(inode)->i_map_sem);
 
-        for (i = first_ext; i < MYFS_MAX_EXTENTS; i++) {
-            if (!index->extents[i].ee_start)
-                break;
-            put_blocks(MYFS_SB(sb), index->extents[i].ee_start,
-                       index->extents[i].ee_len);
-            memset(&index->extents[i], 0, sizeof(struct myfs_extent));
+    return ret;
+}
+
+/*
+ * Called by the VFS for the fallocate() syscall. Supported modes are
+ * preallocation (with or without FALLOC_FL_KEEP_SIZE), which reserves
+ * contiguous unwritten extents, and FALLOC_FL_PUNCH_HOLE, which frees blocks.
+ */
+static long myfs_fallocate(struct file *file,
+                           int mode,
+                           loff_t offset,
+                           loff_t len)
+{
+    struct inode *inode = file_inode(file);
+    loff_t end = offset + len;
+    long ret;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+        return -EOPNOTSUPP;
+    if (end > MYFS_MAX_FILESIZE)
+        return -EFBIG;
+
+    inode_lock(inode);
+    inode_dio_wait(inode);
+
+    /* Extents are needed to preallocate or punch blocks */
+    if (myfs_has_inline_data(inode)) {
+        ret = myfs_inline_convert(inode, 0);
+        if (ret)
+            goto unlock;
+    }
+
+    /* Allocate delayed blocks first, they must not be preallocated */
+    ret = filemap_write_and_wait(inode->i_mapping);
+    if (ret)
+        goto unlock;
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        ret = myfs_punch_hole(file, offset, end);
+        if (ret)
+            goto unlock;
+        inode->i_mtime = current_time(inode);
+    } else {
+        ret = myfs_prealloc(inode, offset / MYFS_BLOCK_SIZE,
+                            DIV_ROUND_UP(end, MYFS_BLOCK_SIZE));
+        if (ret)
+            goto unlock;
+        if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+            i_size_write(inode, end);
+            inode->i_mtime = current_time(inode);
         }
-        mark_buffer_dirty(bh_index);
-        brelse(bh_index);
     }
-end:
+    inode->i_ctime = current_time(inode);
+    mark_inode_dirty(inode);
+
+unlock:
+    inode_unlock(inode);
     return ret;
 }
 
+/*
+ * Called by the VFS for the lseek() syscall. SEEK_HOLE and SEEK_DATA walk the
+ * mappings of iomap_begin(): delayed blocks are data, and unwritten extents
+ * are data only where the page cache has something.
+ */
+static loff_t myfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+    struct inode *inode = file_inode(file);
+
+    switch (whence) {
+    case SEEK_HOLE:
+        inode_lock_shared(inode);
+        offset = iomap_seek_hole(inode, offset, &myfs_iomap_ops);
+        inode_unlock_shared(inode);
+        break;
+    case SEEK_DATA:
+        inode_lock_shared(inode);
+        offset = iomap_seek_data(inode, offset, &myfs_iomap_ops);
+        inode_unlock_shared(inode);
+        break;
+    default:
+        return generic_file_llseek(file, offset, whence);
+    }
+
+    if (offset < 0)
+        return offset;
+    return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+/*
+ * Called by the VFS for the FS_IOC_FIEMAP ioctl on files and directories.
+ * Each extent is reported as mapped by iomap_begin(), along with delayed
+ * ranges and inline data.
+ */
+int myfs_fiemap(struct inode *inode,
+                struct fiemap_extent_info *fieinfo,
+                u64 start,
+                u64 len)
+{
+    return iomap_fiemap(inode, fieinfo, start, len, &myfs_iomap_ops);
+}
+
+/* Called by swapon: the file must be fully mapped by written extents */
+static int myfs_swap_activate(struct swap_info_struct *sis,
+                              struct file *file,
+                              sector_t *span)
+{
+    return iomap_swapfile_activate(sis, file, span, &myfs_iomap_ops);
+}
+
 const struct address_space_operations myfs_aops = {
     .readpage = myfs_readpage,
+    .readahead = myfs_readahead,
     .writepage = myfs_writepage,
+    .writepages = myfs_writepages,
     .write_begin = myfs_write_begin,
     .write_end = myfs_write_end,
+    .set_page_dirty = iomap_set_page_dirty,
+    .releasepage = iomap_releasepage,
+    .invalidatepage = iomap_invalidatepage,
+    .migratepage = iomap_migrate_page,
+    .is_partially_uptodate = iomap_is_partially_uptodate,
+    .error_remove_page = generic_error_remove_page,
+    .direct_IO = noop_direct_IO,
+    .swap_activate = myfs_swap_activate,
 };
 
 const struct file_operations myfs_file_ops = {
-    .llseek = generic_file_llseek,
+    .llseek = myfs_file_llseek,
     .owner = THIS_MODULE,
-    .read_iter = generic_file_read_iter,
-    .write_iter = generic_file_write_iter,
+    .read_iter = myfs_file_read_iter,
+    .write_iter = myfs_file_write_iter,
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
     .fsync = generic_file_fsync,
+    .fallocate = myfs_fallocate,
 };
@@ -47,13 +47,33 @@ static int __init myfs_init(void)
         goto end;
     }
 
+    ret = myfs_init_free_extent_cache();
+    if (ret) {
+        pr_err("free extent cache creation failed\n");
+        goto destroy_inode_cache;
+    }
+
+    ret = myfs_init_dir_cache();
+    if (ret) {
+        pr_err("directory cache creation failed\n");
+        goto destroy_free_extent_cache;
+    }
+
     ret = register_filesystem(&myfs_file_system_type);
     if (ret) {
         pr_err("register_filesystem() failed\n");
-        goto end;
+        goto destroy_dir_cache;
     }
 
     pr_info("module loaded\n");
+    return 0;
+
+destroy_dir_cache:
+    myfs_destroy_dir_cache();
+destroy_free_extent_cache:
+    myfs_destroy_free_extent_cache();
+destroy_inode_cache:
+    myfs_destroy_inode_cache();
 end:
     return ret;
 }
@@ -64,6 +84,8 @@ static void __exit myfs_exit(void)
     if (ret)
         pr_err("unregister_filesystem() failed\n");
 
+    myfs_destroy_dir_cache();
+    myfs_destroy_free_extent_cache();
     myfs_destroy_inode_cache();
 
     pr_info("module unloaded\n");
@@ -53,7 +53,8 @@ struct inode *myfs_iget(struct super_block *sb, unsigned long ino)
     inode->i_mode = le32_to_cpu(cinode->i_mode);
     i_uid_write(inode, le32_to_cpu(cinode->i_uid));
     i_gid_write(inode, le32_to_cpu(cinode->i_gid));
-    inode->i_size = le32_to_cpu(cinode->i_size);
+    inode->i_size = le32_to_cpu(cinode->i_size) |
+                    ((loff_t) le32_to_cpu(cinode->i_size_high) << 32);
     inode->i_ctime.tv_sec = (time64_t) le32_to_cpu(cinode->i_ctime);
     inode->i_ctime.tv_nsec = 0;
     inode->i_atime.tv_sec = (time64_t) le32_to_cpu(cinode->i_atime);
@@ -62,6 +63,8 @@ struct inode *myfs_iget(struct super_block *sb, unsigned long ino)
     inode->i_mtime.tv_nsec = 0;
     inode->i_blocks = le32_to_cpu(cinode->i_blocks);
     set_nlink(inode, le32_to_cpu(cinode->i_nlink));
+    ci->i_flags = le32_to_cpu(cinode->i_flags);
+    memcpy(ci->i_data, cinode->i_data, sizeof(ci->i_data));
 
     if (S_ISDIR(inode->i_mode)) {
         ci->dir_block = le32_to_cpu(cinode->dir_block);
@@ -71,7 +74,6 @@ struct inode *myfs_iget(struct super_block *sb, unsigned long ino)
         inode->i_fop = &myfs_file_ops;
         inode->i_mapping->a_ops = &myfs_aops;
     } else if (S_ISLNK(inode->i_mode)) {
-        strncpy(ci->i_data, cinode->i_data, sizeof(ci->i_data));
         inode->i_link = ci->i_data;
         inode->i_op = &symlink_inode_ops;
     }
@@ -98,39 +100,23 @@ static struct dentry *myfs_lookup(struct inode *dir,
                                       struct dentry *dentry,
                                       unsigned int flags)
 {
-    struct super_block *sb = dir->i_sb;
-    struct myfs_inode_info *ci_dir = MYFS_INODE(dir);
     struct inode *inode = NULL;
-    struct buffer_head *bh = NULL;
-    struct myfs_dir_block *dblock = NULL;
-    struct myfs_file *f = NULL;
-    int i;
+    uint32_t ino;
+    int ret;
 
     /* Check filename length */
     if (dentry->d_name.len > MYFS_FILENAME_LEN)
         return ERR_PTR(-ENAMETOOLONG);
 
-    /* Read the directory block on disk */
-    bh = sb_bread(sb, ci_dir->dir_block);
-    if (!bh)
-        return ERR_PTR(-EIO);
-    dblock = (struct myfs_dir_block *) bh->b_data;
-
     /* Search for the file in directory */
-    for (i = 0; i < MYFS_MAX_SUBFILES; i++) {
-        f = &dblock->files[i];
-        if (!f->inode)
-            break;
-        if (!strncmp(f->filename, dentry->d_name.name, MYFS_FILENAME_LEN)) {
-            inode = myfs_iget(sb, f->inode);
-            break;
-        }
+    ret = myfs_dir_find(dir, &dentry->d_name, &ino);
+    if (ret)
+        return ERR_PTR(ret);
+    if (ino) {
+        inode = myfs_iget(dir->i_sb, ino);
+        if (IS_ERR(inode))
+            return ERR_CAST(inode);
     }
-    brelse(bh);
-
-    /* Update directory access time */
-    dir->i_atime = current_time(dir);
-    mark_inode_dirty(dir);
 
     /* Fill the dentry with the inode */
     d_add(dentry, inode);
@@ -156,14 +142,19 @@ static struct inode *myfs_new_inode(struct inode *dir, mode_t mode)
         return ERR_PTR(-EINVAL);
     }
 
-    /* Check if inodes are available */
+    /*
+     * Check if inodes are available, and a block for directories: files and
+     * symlinks start inline and need none
+     */
     sb = dir->i_sb;
     sbi = MYFS_SB(sb);
-    if (sbi->nr_free_inodes == 0 || sbi->nr_free_blocks == 0)
+    if (percpu_counter_read_positive(&sbi->free_inodes_counter) == 0 ||
+        (S_ISDIR(mode) &&
+         percpu_counter_read_positive(&sbi->free_blocks_counter) == 0))
         return ERR_PTR(-ENOSPC);
 
     /* Get a new free inode */
-    ino = get_free_inode(sbi);
+    ino = get_free_inode(sbi, dir, mode);
     if (!ino)
         return ERR_PTR(-ENOSPC);
 
@@ -183,23 +174,31 @@ static struct inode *myfs_new_inode(struct inode *dir, mode_t mode)
 
     ci = MYFS_INODE(inode);
 
-    /* Get a free block for this new inode's index */
-    bno = get_free_blocks(sbi, 1);
-    if (!bno) {
-        ret = -ENOSPC;
-        goto put_inode;
-    }
-
     /* Initialize inode */
     inode_init_owner(inode, dir, mode);
-    inode->i_blocks = 1;
     if (S_ISDIR(mode)) {
+        /*
+         * Get a free block for the root of the extent tree of this new
+         * directory, near its parent's one. Blocks of entries are added as
+         * the directory grows.
+         */
+        bno = get_free_blocks(sbi, MYFS_INODE(dir)->dir_block, 1);
+        if (!bno) {
+            ret = -ENOSPC;
+            goto put_inode;
+        }
         ci->dir_block = bno;
-        inode->i_size = MYFS_BLOCK_SIZE;
+        ci->i_flags = 0;
+        inode->i_blocks = 1;
+        inode->i_size = 0;
         inode->i_fop = &myfs_dir_ops;
         set_nlink(inode, 2); /* . and .. */
     } else if (S_ISREG(mode)) {
-        ci->ei_block = bno;
+        /* Files start with inline data, they get blocks when they grow */
+        ci->ei_block = 0;
+        ci->i_flags = MYFS_INODE_INLINE;
+        memset(ci->i_data, 0, sizeof(ci->i_data));
+        inode->i_blocks = 0;
         inode->i_size = 0;
         inode->i_fop = &myfs_file_ops;
         inode->i_mapping->a_ops = &myfs_aops;
@@ -220,10 +219,10 @@ put_ino:
 
 /*
  * Create a file or directory in this way:
- *   - check filename length and if the parent directory is not full
+ *   - check filename length
  *   - create the new inode (allocate inode and blocks)
- *   - cleanup index block of the new inode
- *   - add new file/directory in parent index
+ *   - cleanup extent tree root of the new directory
+ *   - add new file/directory in parent directory
  */
 static int myfs_create(struct inode *dir,
                            struct dentry *dentry,
@@ -232,61 +231,40 @@ static int myfs_create(struct inode *dir,
 {
     struct super_block *sb;
     struct inode *inode;
-    struct myfs_inode_info *ci_dir;
-    struct myfs_dir_block *dblock;
     char *fblock;
-    struct buffer_head *bh, *bh2;
-    int ret = 0, i;
+    struct buffer_head *bh;
+    int ret = 0;
 
     /* Check filename length */
-    if (strlen(dentry->d_name.name) > MYFS_FILENAME_LEN)
+    if (dentry->d_name.len > MYFS_FILENAME_LEN)
         return -ENAMETOOLONG;
 
-    /* Read parent directory index */
-    ci_dir = MYFS_INODE(dir);
-    sb = dir->i_sb;
-    bh = sb_bread(sb, ci_dir->dir_block);
-    if (!bh)
-        return -EIO;
-
-    dblock = (struct myfs_dir_block *) bh->b_data;
-
-    /* Check if parent directory is full */
-    if (dblock->files[MYFS_MAX_SUBFILES - 1].inode != 0) {
-        ret = -EMLINK;
-        goto end;
-    }
-
     /* Get a new free inode */
+    sb = dir->i_sb;
     inode = myfs_new_inode(dir, mode);
-    if (IS_ERR(inode)) {
-        ret = PTR_ERR(inode);
-        goto end;
-    }
+    if (IS_ERR(inode))
+        return PTR_ERR(inode);
 
     /*
-     * Scrub ei_block/dir_block for new file/directory to avoid previous data
-     * messing with new file/directory.
+     * Scrub dir_block for new directory to avoid previous data messing with
+     * new directory. New files have no block yet.
      */
-    bh2 = sb_bread(sb, MYFS_INODE(inode)->ei_block);
-    if (!bh2) {
-        ret = -EIO;
-        goto iput;
+    if (S_ISDIR(mode)) {
+        bh = sb_bread(sb, MYFS_INODE(inode)->dir_block);
+        if (!bh) {
+            ret = -EIO;
+            goto iput;
+        }
+        fblock = (char *) bh->b_data;
+        memset(fblock, 0, MYFS_BLOCK_SIZE);
+        mark_buffer_dirty(bh);
+        brelse(bh);
     }
-    fblock = (char *) bh2->b_data;
-    memset(fblock, 0, MYFS_BLOCK_SIZE);
-    mark_buffer_dirty(bh2);
-    brelse(bh2);
-
-    /* Find first free slot in parent index and register new inode */
-    for (i = 0; i < MYFS_MAX_SUBFILES; i++)
-        if (dblock->files[i].inode == 0)
-            break;
-    dblock->files[i].inode = inode->i_ino;
-    strncpy(dblock->files[i].filename, dentry->d_name.name,
-            MYFS_FILENAME_LEN);
-    mark_buffer_dirty(bh);
-    brelse(bh);
+
+    /* Register new inode in parent directory */
+    ret = myfs_dir_add(dir, &dentry->d_name, inode);
+    if (ret)
+        goto iput;
 
     /* Update stats and mark dir and new inode dirty */
     mark_inode_dirty(inode);
@@ -301,11 +279,10 @@ static int myfs_create(struct inode *dir,
     return 0;
 
 iput:
-    put_blocks(MYFS_SB(sb), MYFS_INODE(inode)->ei_block, 1);
+    if (S_ISDIR(mode))
+        put_blocks(MYFS_SB(sb), MYFS_INODE(inode)->dir_block, 1);
     put_inode(MYFS_SB(sb), inode->i_ino);
     iput(inode);
-end:
-    brelse(bh);
     return ret;
 }
 
@@ -322,37 +299,17 @@ static int myfs_unlink(struct inode *dir, struct dentry *dentry)
     struct super_block *sb = dir->i_sb;
     struct myfs_sb_info *sbi = MYFS_SB(sb);
     struct inode *inode = d_inode(dentry);
-    struct buffer_head *bh = NULL, *bh2 = NULL;
-    struct myfs_dir_block *dir_block = NULL;
+    struct buffer_head *bh = NULL;
     struct myfs_file_ei_block *file_block = NULL;
-    int i, j, f_id = -1, nr_subs = 0;
+    int ret;
 
     uint32_t ino = inode->i_ino;
     uint32_t bno = 0;
 
-    /* Read parent directory index */
-    bh = sb_bread(sb, MYFS_INODE(dir)->dir_block);
-    if (!bh)
-        return -EIO;
-    dir_block = (struct myfs_dir_block *) bh->b_data;
-
-    /* Search for inode in parent index and get number of subfiles */
-    for (i = 0; i < MYFS_MAX_SUBFILES; i++) {
-        if (strncmp(dir_block->files[i].filename, dentry->d_name.name,
-                    MYFS_FILENAME_LEN) == 0)
-            f_id = i;
-        else if (dir_block->files[i].inode == 0)
-            break;
-    }
-    nr_subs = i;
-
     /* Remove file from parent directory */
-    if (f_id != MYFS_MAX_SUBFILES - 1)
-        memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
-                (nr_subs - f_id - 1) * sizeof(struct myfs_file));
-    memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct myfs_file));
-    mark_buffer_dirty(bh);
-    brelse(bh);
+    ret = myfs_dir_remove(dir, &dentry->d_name);
+    if (ret)
+        return ret;
 
     if (S_ISLNK(inode->i_mode))
         goto clean_inode;
@@ -372,41 +329,32 @@ static int myfs_unlink(struct inode *dir, struct dentry *dentry)
     }
 
     /*
-     * Cleanup pointed blocks if unlinking a file. If we fail to read the
-     * index block, cleanup inode anyway and lose this file's blocks
-     * forever. If we fail to scrub a data block, don't fail (too late
-     * anyway), just put the block and continue.
+     * Drop the page cache of the file before freeing its blocks: this
+     * ensures no writeback happens on freed blocks. The reservations of the
+     * delayed blocks, which are never allocated, are released.
+     * Then free the data blocks and the extent tree, except for its root,
+     * of the file or directory. Written blocks are scrubbed before being
+     * freed, without going through the buffer cache. If we fail to read the
+     * tree, cleanup inode anyway and lose its blocks forever.
      */
+    if (S_ISREG(inode->i_mode)) {
+        truncate_inode_pages(&inode->i_data, 0);
+        if (myfs_has_inline_data(inode))
+            goto clean_inode;
+    }
+    down_write(&MYFS_INODE(inode)->i_map_sem);
+    myfs_da_remove(inode, 0, U32_MAX);
+    if (myfs_ext_truncate(inode, 0, true))
+        pr_err("failed freeing the blocks of inode %u\n", ino);
+    myfs_ext_cache_drop(inode);
+    up_write(&MYFS_INODE(inode)->i_map_sem);
+
+    /* Scrub the root of the extent tree */
     bno = MYFS_INODE(inode)->ei_block;
     bh = sb_bread(sb, bno);
     if (!bh)
         goto clean_inode;
     file_block = (struct myfs_file_ei_block *) bh->b_data;
-    if (S_ISDIR(inode->i_mode))
-        goto scrub;
-    for (i = 0; i < MYFS_MAX_EXTENTS; i++) {
-        char *block;
-
-        if (!file_block->extents[i].ee_start)
-            break;
-
-        put_blocks(sbi, file_block->extents[i].ee_start,
-                   file_block->extents[i].ee_len);
-
-        /* Scrub the extent */
-        for (j = 0; j < file_block->extents[i].ee_len; j++) {
-            bh2 = sb_bread(sb, file_block->extents[i].ee_start + j);
-            if (!bh2)
-                continue;
-            block = (char *) bh2->b_data;
-            memset(block, 0, MYFS_BLOCK_SIZE);
-            mark_buffer_dirty(bh2);
-            brelse(bh2);
-        }
-    }
-
-scrub:
-    /* Scrub index block */
     memset(file_block, 0, MYFS_BLOCK_SIZE);
     mark_buffer_dirty(bh);
     brelse(bh);
@@ -415,6 +363,8 @@ clean_inode:
     /* Cleanup inode and mark dirty */
     inode->i_blocks = 0;
     MYFS_INODE(inode)->ei_block = 0;
+    MYFS_INODE(inode)->i_flags = 0;
+    memset(MYFS_INODE(inode)->i_data, 0, sizeof(MYFS_INODE(inode)->i_data));
     inode->i_size = 0;
     i_uid_write(inode, 0);
     i_gid_write(inode, 0);
@@ -423,8 +373,9 @@ clean_inode:
     drop_nlink(inode);
     mark_inode_dirty(inode);
 
-    /* Free inode and index block from bitmap */
-    put_blocks(sbi, bno, 1);
+    /* Free inode and index block, if any, from bitmap */
+    if (bno)
+        put_blocks(sbi, bno, 1);
     put_inode(sbi, ino);
 
     return 0;
@@ -436,105 +387,56 @@ static int myfs_rename(struct inode *old_dir,
                            struct dentry *new_dentry,
                            unsigned int flags)
 {
-    struct super_block *sb = old_dir->i_sb;
-    struct myfs_inode_info *ci_old = MYFS_INODE(old_dir);
-    struct myfs_inode_info *ci_new = MYFS_INODE(new_dir);
     struct inode *src = d_inode(old_dentry);
-    struct buffer_head *bh_old = NULL, *bh_new = NULL;
-    struct myfs_dir_block *dir_block = NULL;
-    int i, f_id = -1, new_pos = -1, ret, nr_subs, f_pos = -1;
+    uint32_t ino;
+    int ret;
 
     /* fail with these unsupported flags */
     if (flags & (RENAME_EXCHANGE | RENAME_WHITEOUT))
         return -EINVAL;
 
     /* Check if filename is not too long */
-    if (strlen(new_dentry->d_name.name) > MYFS_FILENAME_LEN)
+    if (new_dentry->d_name.len > MYFS_FILENAME_LEN)
         return -ENAMETOOLONG;
 
-    /* Fail if new_dentry exists or if new_dir is full */
-    bh_new = sb_bread(sb, ci_new->dir_block);
-    if (!bh_new)
-        return -EIO;
-    dir_block = (struct myfs_dir_block *) bh_new->b_data;
-    for (i = 0; i < MYFS_MAX_SUBFILES; i++) {
-        /* if old_dir == new_dir, save the renamed file position */
-        if (new_dir == old_dir) {
-            if (strncmp(dir_block->files[i].filename, old_dentry->d_name.name,
-                        MYFS_FILENAME_LEN) == 0)
-                f_pos = i;
-        }
-        if (strncmp(dir_block->files[i].filename, new_dentry->d_name.name,
-                    MYFS_FILENAME_LEN) == 0) {
-            ret = -EEXIST;
-            goto relse_new;
-        }
-        if (new_pos < 0 && dir_block->files[i].inode == 0)
-            new_pos = i;
-    }
-    /* if old_dir == new_dir, just rename entry */
-    if (old_dir == new_dir) {
-        strncpy(dir_block->files[f_pos].filename, new_dentry->d_name.name,
-                MYFS_FILENAME_LEN);
-        mark_buffer_dirty(bh_new);
-        ret = 0;
-        goto relse_new;
-    }
+    /* Fail if new_dentry exists */
+    ret = myfs_dir_find(new_dir, &new_dentry->d_name, &ino);
+    if (ret)
+        return ret;
+    if (ino)
+        return -EEXIST;
 
-    /* If new directory is empty, fail */
-    if (new_pos < 0) {
-        ret = -EMLINK;
-        goto relse_new;
+    /*
+     * Insert in new parent directory, then remove from the old one. The new
+     * name may belong to another block than the old one, even in the same
+     * directory.
+     */
+    ret = myfs_dir_add(new_dir, &new_dentry->d_name, src);
+    if (ret)
+        return ret;
+    ret = myfs_dir_remove(old_dir, &old_dentry->d_name);
+    if (ret) {
+        myfs_dir_remove(new_dir, &new_dentry->d_name);
+        return ret;
     }
 
-    /* insert in new parent directory */
-    dir_block->files[new_pos].inode = src->i_ino;
-    strncpy(dir_block->files[new_pos].filename, new_dentry->d_name.name,
-            MYFS_FILENAME_LEN);
-    mark_buffer_dirty(bh_new);
-    brelse(bh_new);
-
     /* Update new parent inode metadata */
     new_dir->i_atime = new_dir->i_ctime = new_dir->i_mtime =
         current_time(new_dir);
-    if (S_ISDIR(src->i_mode))
+    if (S_ISDIR(src->i_mode) && new_dir != old_dir)
         inc_nlink(new_dir);
     mark_inode_dirty(new_dir);
 
-    /* remove target from old parent directory */
-    bh_old = sb_bread(sb, ci_old->dir_block);
-    if (!bh_old)
-        return -EIO;
-    dir_block = (struct myfs_dir_block *) bh_old->b_data;
-    /* Search for inode in old directory and number of subfiles */
-    for (i = 0; MYFS_MAX_SUBFILES; i++) {
-        if (dir_block->files[i].inode == src->i_ino)
-            f_id = i;
-        else if (dir_block->files[i].inode == 0)
-            break;
-    }
-    nr_subs = i;
-
-    /* Remove file from old parent directory */
-    if (f_id != MYFS_MAX_SUBFILES - 1)
-        memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
-                (nr_subs - f_id - 1) * sizeof(struct myfs_file));
-    memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct myfs_file));
-    mark_buffer_dirty(bh_old);
-    brelse(bh_old);
-
     /* Update old parent inode metadata */
-    old_dir->i_atime = old_dir->i_ctime = old_dir->i_mtime =
-        current_time(old_dir);
-    if (S_ISDIR(src->i_mode))
-        drop_nlink(old_dir);
-    mark_inode_dirty(old_dir);
+    if (new_dir != old_dir) {
+        old_dir->i_atime = old_dir->i_ctime = old_dir->i_mtime =
+            current_time(old_dir);
+        if (S_ISDIR(src->i_mode))
+            drop_nlink(old_dir);
+        mark_inode_dirty(old_dir);
+    }
 
     return 0;
-
-relse_new:
-    brelse(bh_new);
-    return ret;
 }
 
 
@@ -547,23 +449,17 @@ static int myfs_mkdir(struct inode *dir,
 
 static int myfs_rmdir(struct inode *dir, struct dentry *dentry)
 {
-    struct super_block *sb = dir->i_sb;
     struct inode *inode = d_inode(dentry);
-    struct buffer_head *bh;
-    struct myfs_dir_block *dblock;
+    int ret;
 
     /* If the directory is not empty, fail */
     if (inode->i_nlink > 2)
         return -ENOTEMPTY;
-    bh = sb_bread(sb, MYFS_INODE(inode)->dir_block);
-    if (!bh)
-        return -EIO;
-    dblock = (struct myfs_dir_block *) bh->b_data;
-    if (dblock->files[0].inode != 0) {
-        brelse(bh);
+    ret = myfs_dir_is_empty(inode);
+    if (ret < 0)
+        return ret;
+    if (!ret)
         return -ENOTEMPTY;
-    }
-    brelse(bh);
 
     /* Remove directory with unlink */
     return myfs_unlink(dir, dentry);
@@ -574,84 +470,48 @@ static int myfs_link(struct dentry *old_dentry,
                          struct dentry *dentry)
 {
     struct inode *inode = d_inode(old_dentry);
-    struct super_block *sb = inode->i_sb;
-    struct myfs_inode_info *ci_dir = MYFS_INODE(dir);
-    struct myfs_dir_block *dir_block;
-    struct buffer_head *bh;
-    int f_pos = -1, ret = 0, i = 0;
-
-    bh = sb_bread(sb, ci_dir->dir_block);
-    if (!bh)
-        return -EIO;
-    dir_block = (struct myfs_dir_block *) bh->b_data;
-
-    if (dir_block->files[MYFS_MAX_SUBFILES - 1].inode != 0) {
-        ret = -EMLINK;
-        printk(KERN_INFO "directory is full");
-        goto end;
-    }
+    int ret;
 
-    for (i = 0; i < MYFS_MAX_SUBFILES; i++) {
-        if (dir_block->files[i].inode == 0) {
-            f_pos = i;
-            break;
-        }
-    }
+    /* Check filename length */
+    if (dentry->d_name.len > MYFS_FILENAME_LEN)
+        return -ENAMETOOLONG;
 
-    dir_block->files[f_pos].inode = inode->i_ino;
-    strncpy(dir_block->files[f_pos].filename, dentry->d_name.name,
-            MYFS_FILENAME_LEN);
-    mark_buffer_dirty(bh);
+    ret = myfs_dir_add(dir, &dentry->d_name, inode);
+    if (ret)
+        return ret;
 
     inode_inc_link_count(inode);
+    ihold(inode);
     d_instantiate(dentry, inode);
-end:
-    brelse(bh);
-    return ret;
+    return 0;
 }
 
 static int myfs_symlink(struct inode *dir,
                             struct dentry *dentry,
                             const char *symname)
 {
-    struct super_block *sb = dir->i_sb;
     unsigned int l = strlen(symname) + 1;
-    struct inode *inode = myfs_new_inode(dir, S_IFLNK | S_IRWXUGO);
-    struct myfs_inode_info *ci = MYFS_INODE(inode);
-    struct myfs_inode_info *ci_dir = MYFS_INODE(dir);
-    struct myfs_dir_block *dir_block;
-    struct buffer_head *bh;
-    int f_pos = 0, i = 0;
+    struct inode *inode;
+    struct myfs_inode_info *ci;
+    int ret;
 
-    /* Check if symlink content is not too long */
-    if (l > sizeof(ci->i_data))
+    /* Check if filename and symlink content are not too long */
+    if (dentry->d_name.len > MYFS_FILENAME_LEN || l > MYFS_INLINE_DATA_SIZE)
         return -ENAMETOOLONG;
 
-    /* fill directory data block */
-    bh = sb_bread(sb, ci_dir->dir_block);
-
-    if (!bh)
-        return -EIO;
-    dir_block = (struct myfs_dir_block *) bh->b_data;
+    inode = myfs_new_inode(dir, S_IFLNK | S_IRWXUGO);
+    if (IS_ERR(inode))
+        return PTR_ERR(inode);
+    ci = MYFS_INODE(inode);
 
-    if (dir_block->files[MYFS_MAX_SUBFILES - 1].inode != 0) {
-        printk(KERN_INFO "directory is full\n");
-        return -EMLINK;
+    /* Register new inode in parent directory */
+    ret = myfs_dir_add(dir, &dentry->d_name, inode);
+    if (ret) {
+        put_inode(MYFS_SB(dir->i_sb), inode->i_ino);
+        iput(inode);
+        return ret;
     }
 
-    for (i = 0; i < MYFS_MAX_SUBFILES; i++) {
-        if (dir_block->files[i].inode == 0) {
-            f_pos = i;
-            break;
-        }
-    }
-
-    dir_block->files[f_pos].inode = inode->i_ino;
-    strncpy(dir_block->files[f_pos].filename, dentry->d_name.name,
-            MYFS_FILENAME_LEN);
-    mark_buffer_dirty(bh);
-    brelse(bh);
-
     inode->i_link = (char *) ci->i_data;
     memcpy(inode->i_link, symname, l);
     inode->i_size = l - 1;
@@ -661,6 +521,30 @@ static int myfs_symlink(struct inode *dir,
     return 0;
 }
 
+/*
+ * Change the attributes of an inode. Size changes of regular files free or
+ * zero what is cut.
+ */
+static int myfs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+    struct inode *inode = d_inode(dentry);
+    int ret;
+
+    ret = setattr_prepare(dentry, attr);
+    if (ret)
+        return ret;
+
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != inode->i_size) {
+        ret = myfs_truncate(inode, attr->ia_size);
+        if (ret)
+            return ret;
+    }
+
+    setattr_copy(inode, attr);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
 static const char *myfs_get_link(struct dentry *dentry,
                                      struct inode *inode,
                                      struct delayed_call *done)
@@ -677,6 +561,8 @@ static const struct inode_operations myfs_inode_ops = {
     .rename = myfs_rename,
     .link = myfs_link,
     .symlink = myfs_symlink,
+    .setattr = myfs_setattr,
+    .fiemap = myfs_fiemap,
 };
 
 static const struct inode_operations symlink_inode_ops = {
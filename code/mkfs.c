@@ -12,7 +12,7 @@
 
 struct superblock {
     struct myfs_sb_info info;
-    char padding[4064]; /* Padding to match block size */
+    char padding[4048]; /* Padding to match block size */
 };
 
 /* Returns ceil(a/b) */
@@ -53,6 +53,21 @@ static struct superblock *write_superblock(int fd, struct stat *fstats)
         .nr_free_blocks = htole32(nr_data_blocks - 1),
     };
 
+    /* Random key of the directory name hash, never all zeroes */
+    int rfd = open("/dev/urandom", O_RDONLY);
+    if (rfd < 0 || read(rfd, sb->info.hash_seed, sizeof(sb->info.hash_seed)) !=
+                       sizeof(sb->info.hash_seed)) {
+        perror("/dev/urandom");
+        if (rfd >= 0)
+            close(rfd);
+        free(sb);
+        return NULL;
+    }
+    close(rfd);
+    if (!(sb->info.hash_seed[0] | sb->info.hash_seed[1] |
+          sb->info.hash_seed[2] | sb->info.hash_seed[3]))
+        sb->info.hash_seed[0] = htole32(1);
+
     int ret = write(fd, sb, sizeof(struct superblock));
     if (ret != sizeof(struct superblock)) {
         free(sb);
@@ -94,7 +109,7 @@ static int write_inode_store(int fd, struct superblock *sb)
                             S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH);
     inode->i_uid = 0;
     inode->i_gid = 0;
-    inode->i_size = htole32(MYFS_BLOCK_SIZE);
+    inode->i_size = 0; /* Empty, only the root of its extent tree */
     inode->i_ctime = inode->i_atime = inode->i_mtime = htole32(0);
     inode->i_blocks = htole32(1);
     inode->i_nlink = htole32(2);
@@ -179,31 +194,16 @@ static int write_bfree_blocks(int fd, struct superblock *sb)
     uint64_t *bfree = (uint64_t *) block;
 
     /*
-     * First blocks (incl. sb + istore + ifree + bfree + 1 used block)
-     * we suppose it won't go further than the first block
+     * First blocks (incl. sb + istore + ifree + bfree + 1 used block), which
+     * may span several bitmap blocks on large images
      */
-    memset(bfree, 0xff, MYFS_BLOCK_SIZE);
-    uint32_t i = 0;
-    while (nr_used) {
-        uint64_t line = 0xffffffffffffffff;
-        for (uint64_t mask = 0x1; mask; mask <<= 1) {
-            line &= ~mask;
-            nr_used--;
-            if (!nr_used)
-                break;
-        }
-        bfree[i] = htole64(line);
-        i++;
-    }
-    int ret = write(fd, bfree, MYFS_BLOCK_SIZE);
-    if (ret != MYFS_BLOCK_SIZE) {
-        ret = -1;
-        goto end;
-    }
-
-    /* other blocks */
-    memset(bfree, 0xff, MYFS_BLOCK_SIZE);
-    for (i = 1; i < le32toh(sb->info.nr_bfree_blocks); i++) {
+    uint32_t i, bit;
+    int ret = 0;
+    for (i = 0; i < le32toh(sb->info.nr_bfree_blocks); i++) {
+        memset(bfree, 0xff, MYFS_BLOCK_SIZE);
+        for (bit = 0; bit < MYFS_BLOCK_SIZE * 8 && nr_used; bit++, nr_used--)
+            bfree[bit / 64] =
+                htole64(le64toh(bfree[bit / 64]) & ~(1ULL << (bit % 64)));
         ret = write(fd, bfree, MYFS_BLOCK_SIZE);
         if (ret != MYFS_BLOCK_SIZE) {
             ret = -1;
@@ -221,8 +221,21 @@ end:
 
 static int write_data_blocks(int fd, struct superblock *sb)
 {
-    /* FIXME: unimplemented */
-    return 0;
+    /*
+     * First data block: the root of the extent tree of the root directory,
+     * which must read as an empty leaf, whatever the device held before
+     */
+    char *block = calloc(1, MYFS_BLOCK_SIZE);
+    if (!block)
+        return -1;
+
+    int ret = write(fd, block, MYFS_BLOCK_SIZE);
+    ret = ret == MYFS_BLOCK_SIZE ? 0 : -1;
+    if (!ret)
+        printf("Data blocks: wrote the root directory extent tree\n");
+
+    free(block);
+    return ret;
 }
 
 int main(int argc, char **argv)
@@ -6,33 +6,79 @@
 #define MYFS_SB_BLOCK_NR 0
 
 #define MYFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
-#define MYFS_MAX_EXTENTS \
-    MYFS_BLOCK_SIZE / sizeof(struct myfs_extent)
-#define MYFS_MAX_BLOCKS_PER_EXTENT 8 /* It can be ~(uint32) 0 */
-#define MYFS_MAX_FILESIZE                                      \
-    (uint64_t) MYFS_MAX_BLOCKS_PER_EXTENT *MYFS_BLOCK_SIZE \
-        *MYFS_MAX_EXTENTS
-#define MYFS_FILENAME_LEN 28
-#define MYFS_MAX_SUBFILES 128
+#define MYFS_MAX_BLOCKS_PER_EXTENT (1 << 15) /* ee_len is 16-bit */
+/* Entries of the extent tree nodes (see struct myfs_file_ei_block) */
+#define MYFS_EXT_LEAF_MAX                                        \
+    ((MYFS_BLOCK_SIZE - sizeof(struct myfs_extent_header)) / \
+     sizeof(struct myfs_extent))
+#define MYFS_EXT_IDX_MAX                                         \
+    ((MYFS_BLOCK_SIZE - sizeof(struct myfs_extent_header)) / \
+     sizeof(struct myfs_extent_idx))
+#define MYFS_EXT_MAX_DEPTH 4
+/*
+ * Logical block numbers are 32-bit, keep the end of the last block of a file
+ * representable.
+ */
+#define MYFS_MAX_FILESIZE ((uint64_t) MYFS_BLOCK_SIZE << 31) /* 8 TiB */
+/* Bytes of file data or symlink target stored in the inode itself */
+#define MYFS_INLINE_DATA_SIZE 80
+#define MYFS_FILENAME_LEN 255
 
+#ifdef __KERNEL__
+/* A run of free blocks, indexed both by first block and by length */
+struct myfs_free_extent {
+    struct rb_node rb_start;
+    struct rb_node rb_len;
+    uint32_t fe_start; /* first free block of the run */
+    uint32_t fe_len;   /* number of free blocks in the run */
+};
+
+struct myfs_free_index {
+    struct rb_root by_start;
+    struct rb_root by_len;
+};
+
+/* Number of free runs looked at on each side of an allocation goal */
+#define MYFS_GOAL_SCAN 16
+
+/* Allocation group: the inodes or blocks covered by one bitmap block */
+#define MYFS_INODES_PER_GROUP (MYFS_BLOCK_SIZE * 8)
+#define MYFS_BLOCKS_PER_GROUP (MYFS_BLOCK_SIZE * 8)
+
+struct myfs_group {
+    spinlock_t lock;               /* Protects the fields below and the
+                                      group's slice of the bitmap */
+    uint32_t first;                /* First inode/block of the group */
+    uint32_t count;                /* Number of inodes/blocks in the group */
+    uint32_t nr_free;              /* Number of free inodes/blocks */
+    bool dirty;                    /* Bitmap block changed since last sync */
+    struct myfs_free_index index;  /* Free runs (block groups only) */
+} ____cacheline_aligned_in_smp;
+#endif
 
 struct myfs_inode {
     uint32_t i_mode;   /* File mode */
     uint32_t i_uid;    /* Owner id */
     uint32_t i_gid;    /* Group id */
-    uint32_t i_size;   /* Size in bytes */
+    uint32_t i_size;   /* Size in bytes (low 32 bits) */
+    uint32_t i_size_high; /* Size in bytes (high 32 bits) */
     uint32_t i_ctime;  /* Inode change time */
     uint32_t i_atime;  /* Access time */
     uint32_t i_mtime;  /* Modification time */
     uint32_t i_blocks; /* Block count */
     uint32_t i_nlink;  /* Hard links count */
     union {
-        uint32_t ei_block;  /* Block with list of extents for this file */
-        uint32_t dir_block; /* Block with list of files for this directory */
+        uint32_t ei_block;  /* Root of the extent tree of this file */
+        uint32_t dir_block; /* Root of the extent tree of this directory */
     };
-    char i_data[32]; /* store symlink content */
+    uint32_t i_flags;  /* MYFS_INODE_* flags */
+    char i_data[MYFS_INLINE_DATA_SIZE]; /* store symlink or inline content */
 };
 
+/* Inode flags */
+#define MYFS_INODE_INLINE 0x0001 /* file data is in i_data, no ei_block */
+#define MYFS_INODE_INDEX 0x0002  /* directory is indexed by name hash */
+
 #define MYFS_INODES_PER_BLOCK (MYFS_BLOCK_SIZE / sizeof(struct myfs_inode))
 
 struct myfs_sb_info {
@@ -45,12 +91,25 @@ struct myfs_sb_info {
     uint32_t nr_ifree_blocks;  /* Number of inode free bitmap blocks */
     uint32_t nr_bfree_blocks;  /* Number of block free bitmap blocks */
 
-    uint32_t nr_free_inodes; /* Number of free inodes */
-    uint32_t nr_free_blocks; /* Number of free blocks */
+    uint32_t nr_free_inodes; /* Number of free inodes (on disk) */
+    uint32_t nr_free_blocks; /* Number of free blocks (on disk) */
+
+    uint32_t hash_seed[4]; /* Key of the directory name hash, never 0 */
 
 #ifdef __KERNEL__
     unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
     unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
+
+    uint32_t nr_igroups;          /* Number of inode groups */
+    uint32_t nr_bgroups;          /* Number of block groups */
+    struct myfs_group *igroups;   /* Inode groups */
+    struct myfs_group *bgroups;   /* Block groups */
+    struct percpu_counter free_inodes_counter; /* In-memory free inodes */
+    struct percpu_counter free_blocks_counter; /* In-memory free blocks */
+    struct percpu_counter dirty_blocks_counter; /* Blocks reserved by delayed
+                                                   allocation */
+    struct workqueue_struct *unwritten_wq; /* Completes writes to unwritten
+                                              extents (see file.c) */
 #endif
 };
 
@@ -58,28 +117,108 @@ struct myfs_sb_info {
 
 struct myfs_inode_info {
     union {
-        uint32_t ei_block;  /* Block with list of extents for this file */
-        uint32_t dir_block; /* Block with list of files for this directory */
+        uint32_t ei_block;  /* Root of the extent tree of this file */
+        uint32_t dir_block; /* Root of the extent tree of this directory */
     };
-    char i_data[32];
+    uint32_t i_flags;
+    char i_data[MYFS_INLINE_DATA_SIZE];
+    spinlock_t i_reserve_lock; /* Protects i_reserved */
+    uint32_t i_reserved;       /* Blocks reserved for delayed allocation */
+    struct rw_semaphore i_map_sem; /* Protects the extents and their cache */
+    struct myfs_extent *i_extents; /* Cached extents (see extent.c) */
+    uint32_t i_nr_extents;         /* Number of cached extents */
+    uint32_t i_max_extents;        /* Room in i_extents */
+    bool i_extents_valid;          /* Is the extent cache loaded? */
+    unsigned int i_map_seq;        /* Bumped on each change of the extents */
+    struct rb_root i_delayed;      /* Delayed block ranges (see file.c) */
+    spinlock_t i_ioend_lock;       /* Protects i_ioend_list */
+    struct list_head i_ioend_list; /* Written ioends to complete */
+    struct work_struct i_ioend_work; /* Completes i_ioend_list (see file.c) */
+    struct rw_semaphore i_dir_sem; /* Protects the blocks of a directory */
+    seqlock_t i_dir_seqlock;       /* Lockless lookups in i_dir_cache */
+    struct myfs_dir_cache __rcu *i_dir_cache; /* Names of a directory
+                                                 (see dir.c) */
     struct inode vfs_inode;
 };
 
 struct myfs_extent {
     uint32_t ee_block; /* first logical block extent covers */
-    uint32_t ee_len;   /* number of blocks covered by extent */
+    uint16_t ee_len;   /* number of blocks covered by extent */
+    uint16_t ee_flags; /* MYFS_EXT_* flags */
     uint32_t ee_start; /* first physical block extent covers */
 };
 
+/* Extent flags */
+#define MYFS_EXT_UNWRITTEN 0x0001 /* allocated but never written, reads as 0 */
+
+/*
+ * Extents are kept in a B+tree rooted at ei_block. Each node is a block
+ * starting with a header: leaves (depth 0) hold extents, index nodes hold the
+ * first logical block and the location of each child. Entries are sorted by
+ * logical block. A zeroed block is an empty leaf.
+ */
+struct myfs_extent_header {
+    uint16_t eh_entries; /* number of used entries */
+    uint16_t eh_depth;   /* levels of nodes below this one */
+    uint32_t eh_reserved;
+};
+
+struct myfs_extent_idx {
+    uint32_t ix_block; /* first logical block the child covers */
+    uint32_t ix_leaf;  /* block of the child node */
+};
+
 struct myfs_file_ei_block {
-    struct myfs_extent extents[MYFS_MAX_EXTENTS];
+    struct myfs_extent_header header;
+    union {
+        struct myfs_extent extents[MYFS_EXT_LEAF_MAX];
+        struct myfs_extent_idx idx[MYFS_EXT_IDX_MAX];
+    };
+};
+
+/*
+ * Directories are made of blocks mapped by an extent tree rooted at dir_block,
+ * like files. Blocks holding entries are made of variable-length records,
+ * each one giving the length to the next one. The last record of a block
+ * extends to its end, an empty block is a single unused record. Removed
+ * entries are left as unused records (tombstones) until reused or compacted.
+ */
+struct myfs_dir_entry {
+    uint32_t inode;    /* inode number, 0 if the record is unused */
+    uint16_t rec_len;  /* length of this record */
+    uint8_t name_len;  /* length of name */
+    uint8_t file_type; /* FT_* type of the inode, as in ext2 */
+    char name[];       /* not NUL-terminated */
+};
+
+/* Space used by a record with a name of len bytes, 4-byte aligned */
+#define MYFS_DIR_REC_LEN(len) \
+    ((sizeof(struct myfs_dir_entry) + (len) + 3) & ~3U)
+
+/*
+ * Hash index of a directory (MYFS_INODE_INDEX). Block 0 is the root, mapping
+ * ranges of name hashes to directory blocks, either the blocks holding the
+ * entries or, below a root of depth 1, index nodes which do. Index blocks
+ * start with an unused record spanning the whole block, so that they look
+ * empty to linear scans.
+ */
+struct myfs_dx_entry {
+    uint32_t hash;  /* lowest name hash covered by the child */
+    uint32_t block; /* logical block of the child in the directory */
 };
 
-struct myfs_dir_block {
-    struct myfs_file {
-        uint32_t inode;
-        char filename[MYFS_FILENAME_LEN];
-    } files[MYFS_MAX_SUBFILES];
+#define MYFS_DX_MAX                                                 \
+    ((MYFS_BLOCK_SIZE - sizeof(struct myfs_dir_entry) -             \
+      2 * sizeof(uint32_t)) /                                       \
+     sizeof(struct myfs_dx_entry))
+#define MYFS_DX_MAX_DEPTH 1
+
+struct myfs_dx_node {
+    struct myfs_dir_entry fake; /* unused record spanning the block */
+    uint16_t count;        /* number of entries */
+    uint16_t depth;        /* root only: levels of index nodes below */
+    uint32_t reserved;
+    struct myfs_dx_entry entries[MYFS_DX_MAX];
 };
 
 /* superblock functions */
@@ -90,20 +229,94 @@ int myfs_init_inode_cache(void);
 void myfs_destroy_inode_cache(void);
 struct inode *myfs_iget(struct super_block *sb, unsigned long ino);
 
+/* directory functions */
+int myfs_dir_find(struct inode *dir, const struct qstr *name, uint32_t *ino);
+int myfs_dir_add(struct inode *dir,
+                 const struct qstr *name,
+                 struct inode *inode);
+int myfs_dir_remove(struct inode *dir, const struct qstr *name);
+int myfs_dir_is_empty(struct inode *dir);
+void myfs_dir_cache_drop(struct inode *dir);
+int myfs_init_dir_cache(void);
+void myfs_destroy_dir_cache(void);
+
 /* file functions */
 extern const struct file_operations myfs_file_ops;
 extern const struct file_operations myfs_dir_ops;
 extern const struct address_space_operations myfs_aops;
+int myfs_truncate(struct inode *inode, loff_t size);
+uint32_t myfs_da_remove(struct inode *inode, uint32_t start, uint32_t len);
+void myfs_end_io(struct work_struct *work);
+int myfs_fiemap(struct inode *inode,
+                struct fiemap_extent_info *fieinfo,
+                u64 start,
+                u64 len);
+
+/* free extent index functions */
+int myfs_init_free_extent_cache(void);
+void myfs_destroy_free_extent_cache(void);
+int myfs_free_index_build(struct myfs_free_index *fi,
+                          unsigned long *freemap,
+                          unsigned long first,
+                          unsigned long size);
+void myfs_free_index_destroy(struct myfs_free_index *fi);
+uint32_t myfs_free_index_take(struct myfs_free_index *fi, uint32_t len);
+uint32_t myfs_free_index_take_near(struct myfs_free_index *fi,
+                                   uint32_t goal,
+                                   uint32_t len,
+                                   struct myfs_free_extent **spare);
+void myfs_free_index_put(struct myfs_free_index *fi,
+                         uint32_t bno,
+                         uint32_t len,
+                         struct myfs_free_extent **spare);
+
+/* allocation group functions */
+int myfs_groups_init(struct myfs_sb_info *sbi);
+void myfs_groups_destroy(struct myfs_sb_info *sbi);
+uint32_t myfs_group_take_inode(struct myfs_sb_info *sbi, uint32_t group);
+void myfs_group_put_inode(struct myfs_sb_info *sbi, uint32_t ino);
+uint32_t myfs_group_take_blocks(struct myfs_sb_info *sbi,
+                                uint32_t group,
+                                uint32_t goal,
+                                uint32_t len);
+void myfs_group_put_blocks(struct myfs_sb_info *sbi, uint32_t bno, uint32_t len);
 
 /* extent functions */
-extern uint32_t myfs_ext_search(struct myfs_file_ei_block *index,
-                                    uint32_t iblock);
+int myfs_ext_lookup(const struct myfs_extent *extents,
+                    uint32_t nr,
+                    uint32_t iblock);
+int myfs_ext_find(struct inode *inode,
+                  uint32_t iblock,
+                  struct myfs_extent *ext);
+int myfs_ext_insert(struct inode *inode, const struct myfs_extent *new);
+int myfs_ext_set_flags(struct inode *inode,
+                       uint32_t iblock,
+                       uint32_t len,
+                       uint16_t flags);
+int myfs_ext_remove_blocks(struct inode *inode,
+                           uint32_t iblock,
+                           uint32_t len);
+int myfs_ext_truncate(struct inode *inode, uint32_t from, bool zero);
+int myfs_ext_walk(struct inode *inode,
+                  int (*fn)(struct myfs_extent *ext, void *data),
+                  void *data);
+void myfs_ext_cache_drop(struct inode *inode);
+int myfs_ext_cache_read_lock(struct inode *inode);
+int myfs_ext_cache_write_lock(struct inode *inode);
+struct myfs_extent *myfs_ext_cache_lookup(struct inode *inode, uint32_t iblock);
+struct myfs_extent *myfs_ext_cache_next(struct inode *inode, uint32_t iblock);
 
 /* Getters for superbock and inode */
 #define MYFS_SB(sb) (sb->s_fs_info)
 #define MYFS_INODE(inode) \
     (container_of(inode, struct myfs_inode_info, vfs_inode))
 
+/* Is the data of inode stored inline? */
+static inline bool myfs_has_inline_data(struct inode *inode)
+{
+    return MYFS_INODE(inode)->i_flags & MYFS_INODE_INLINE;
+}
+
 #endif /* __KERNEL__ */
 
 #endif /* MYFS_H */
@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+#
+# Send a file N times to a local TCP socket, by sendfile() or by a read() and
+# send() loop, and print the rate. Used by script/test.sh:
+#
+#   script/sendfile.py FILE N sendfile|copy
+
+import os
+import socket
+import sys
+import threading
+import time
+
+
+def sink(server, received):
+    conn, _ = server.accept()
+    buf = bytearray(1 << 20)
+    while True:
+        n = conn.recv_into(buf)
+        if not n:
+            break
+        received[0] += n
+    conn.close()
+
+
+def main():
+    path, count, mode = sys.argv[1], int(sys.argv[2]), sys.argv[3]
+    size = os.path.getsize(path)
+
+    server = socket.socket()
+    server.bind(("127.0.0.1", 0))
+    server.listen(1)
+    received = [0]
+    thread = threading.Thread(target=sink, args=(server, received))
+    thread.start()
+    sock = socket.create_connection(server.getsockname())
+
+    fd = os.open(path, os.O_RDONLY)
+    start = time.monotonic()
+    for _ in range(count):
+        if mode == "sendfile":
+            off = 0
+            while off < size:
+                off += os.sendfile(sock.fileno(), fd, off, size - off)
+        else:
+            os.lseek(fd, 0, os.SEEK_SET)
+            while True:
+                data = os.read(fd, 1 << 20)
+                if not data:
+                    break
+                sock.sendall(data)
+    sock.close()
+    thread.join()
+    elapsed = time.monotonic() - start
+    os.close(fd)
+
+    if received[0] != size * count:
+        sys.exit("received %d bytes out of %d" % (received[0], size * count))
+    print("%.1f MiB/s" % (size * count / elapsed / (1 << 20)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,646 @@
+#!/usr/bin/env bash
+#
+# Checks and benchmarks of myfs, run by "make check" as root or through sudo:
+#
+#   script/test.sh IMAGE IMAGESIZE MKFS
+#
+# IMAGESIZE is in MiB. Each check makes a fresh filesystem in IMAGE, of
+# IMAGESIZE or of the size it needs (sparse), and mounts it on $MNT. Checks
+# fail the run on any error. Benchmarks print their measurements and only fail
+# on errors, timings are not compared against thresholds. BENCH=0 skips the
+# benchmarks, and DIR_SIZES lists the directory sizes bench_dir runs with.
+
+if [ $# -ne 3 ]; then
+    echo "Usage: $0 IMAGE IMAGESIZE MKFS" >&2
+    exit 2
+fi
+
+IMAGE=$1
+IMAGESIZE=$2
+MKFS=$3
+MNT=${MNT:-test}
+BENCH=${BENCH:-1}
+
+SUDO=
+[ "$(id -u)" -eq 0 ] || SUDO=sudo
+
+fail()
+{
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+skip()
+{
+    echo "  skipped: $*"
+}
+
+# Print a measurement
+report()
+{
+    printf "  %-48s %s\n" "$1" "$2"
+}
+
+now()
+{
+    date +%s.%N
+}
+
+# Print the seconds elapsed since $1, a time printed by now
+elapsed()
+{
+    awk -v a="$1" -v b="$(now)" 'BEGIN { printf "%.3f", b - a }'
+}
+
+# Print the rate of $1 bytes in $2 seconds
+rate()
+{
+    awk -v b="$1" -v s="$2" 'BEGIN { printf "%.1f MiB/s", b / 1048576 / s }'
+}
+
+# Print the average number of extents of files $@, as reported by FIEMAP
+extents()
+{
+    filefrag "$@" | awk '{ n += $(NF - 2) } END { printf "%.1f", n / NR }'
+}
+
+# Print field $1 of the I/O statistics of the device of the mounted image:
+# 1 reads, 3 sectors read, 5 writes, 7 sectors written
+dev_stat()
+{
+    awk -v f="$1" '{ print $f }' "/sys/block/$(dev_name)/stat"
+}
+
+# Name of the device of the mounted image
+dev_name()
+{
+    basename "$(findmnt -n -o SOURCE "$MNT")"
+}
+
+# Run a fio job doing $1 (read or write) on file $2 of $3 MiB by 1 MiB
+# requests, with further fio arguments, and print its rate and CPU use
+fio_run()
+{
+    local rw=$1 file=$2 size=$3
+
+    shift 3
+    fio --minimal --name=myfs --filename="$file" --rw="$rw" --bs=1M \
+        --size="${size}M" --ioengine=psync "$@" |
+        awk -F';' -v rw="$rw" '{
+            printf "%.1f MiB/s, %.1f%% CPU",
+                   (rw == "read" ? $7 : $48) / 1024, $88 + $89 }'
+}
+
+# Print the microseconds per entry of $2 entries processed in $1 seconds
+per_entry()
+{
+    awk -v s="$1" -v n="$2" 'BEGIN { printf "%.1f us/entry", s * 1e6 / n }'
+}
+
+umount_fs()
+{
+    if mountpoint -q "$MNT"; then
+        $SUDO umount "$MNT"
+    fi
+}
+
+mount_fs()
+{
+    $SUDO mount -t myfs -o loop "$IMAGE" "$MNT" || fail "mount $IMAGE"
+    $SUDO chmod 777 "$MNT"
+}
+
+# Make a fresh filesystem of $1 MiB and mount it
+new_fs()
+{
+    umount_fs || fail "umount $MNT"
+    rm -f "$IMAGE"
+    truncate -s "${1}M" "$IMAGE" || fail "create $IMAGE"
+    ./"$MKFS" "$IMAGE" > /dev/null || fail "mkfs $IMAGE"
+    mount_fs
+}
+
+# Unmount and mount again, which drops all the caches of the filesystem
+remount()
+{
+    umount_fs || fail "umount $MNT"
+    mount_fs
+}
+
+# Free blocks, as seen by unprivileged users
+free_blocks()
+{
+    stat -f -c %a "$MNT"
+}
+
+cleanup()
+{
+    umount_fs
+    [ -z "$LOADED" ] || $SUDO rmmod simplefs
+    rm -f "$IMAGE"
+    rmdir "$MNT" 2> /dev/null
+}
+
+# Basic operations, and that their results survive a remount
+check_smoke()
+{
+    local free i
+
+    new_fs "$IMAGESIZE"
+    mkdir "$MNT/dir" || fail "mkdir"
+    # The root directory keeps its first block
+    free=$(free_blocks)
+
+    echo hello > "$MNT/dir/small" || fail "write small file"
+    head -c 1M /dev/urandom > "$MNT/dir/big" || fail "write big file"
+    ln "$MNT/dir/big" "$MNT/dir/hard" || fail "link"
+    ln -s small "$MNT/dir/sym" || fail "symlink"
+    mv "$MNT/dir/hard" "$MNT/moved" || fail "rename"
+    # More than a block of entries, so that the directory is indexed
+    for i in $(seq 300); do
+        echo "$i" > "$MNT/dir/file$i" || fail "create file$i"
+    done
+    cmp "$MNT/dir/big" "$MNT/moved" || fail "hard link content"
+    cp "$MNT/dir/big" "$IMAGE.big"
+
+    remount
+    [ "$(cat "$MNT/dir/small")" = hello ] || fail "small file content"
+    cmp "$IMAGE.big" "$MNT/dir/big" || fail "big file content"
+    cmp "$IMAGE.big" "$MNT/moved" || fail "renamed link content"
+    rm -f "$IMAGE.big"
+    [ "$(readlink "$MNT/dir/sym")" = small ] || fail "symlink target"
+    [ "$(stat -c %h "$MNT/moved")" = 2 ] || fail "link count"
+    [ "$(ls "$MNT/dir" | wc -l)" = 303 ] || fail "directory entries"
+    [ "$(cat "$MNT/dir/file150")" = 150 ] || fail "file150 content"
+
+    rmdir "$MNT/dir" 2> /dev/null && fail "rmdir of a non-empty directory"
+    rm -r "$MNT/dir/"* || fail "rm -r"
+    rmdir "$MNT/dir" || fail "rmdir"
+    [ "$(ls "$MNT")" = moved ] || fail "entries left after rm -r"
+    rm "$MNT/moved" || fail "unlink"
+    mkdir "$MNT/dir" || fail "mkdir"
+
+    # Everything freed
+    remount
+    [ "$(free_blocks)" = "$free" ] || fail "leaked $((free - $(free_blocks))) blocks"
+}
+
+# user-001: block allocation latency as the disk fills up. The disk is filled
+# with 1 MiB files, one in four deleted to fragment the free space, and at each
+# level the time to write 200 files of 64 KiB and sync them is measured. It
+# should stay flat from empty to 95% full.
+bench_alloc()
+{
+    local pct total t i n=0
+
+    new_fs 1024
+    total=$(stat -f -c %b "$MNT")
+    mkdir "$MNT/fill" "$MNT/probe"
+    for pct in 0 25 50 75 90 95; do
+        while [ $(((total - $(free_blocks)) * 100 / total)) -lt "$pct" ]; do
+            n=$((n + 1))
+            head -c 1M /dev/zero > "$MNT/fill/$n" || fail "fill to $pct%"
+            if [ $((n % 4)) -eq 0 ]; then
+                rm "$MNT/fill/$((n - 1))"
+            fi
+        done
+        sync
+
+        t=$(now)
+        for i in $(seq 200); do
+            head -c 64K /dev/zero > "$MNT/probe/$i" || fail "write at $pct%"
+        done
+        sync
+        report "$pct% full, 200 x 64 KiB files" "$(elapsed "$t") s"
+        rm "$MNT/probe"/*
+    done
+}
+
+# user-003: file layout on an aged image. Appends to 4 files are interleaved
+# with small files, half of which are then deleted, and 4 files are written
+# concurrently in the holes. Reports extents per file, and the rate of cold
+# sequential reads of the appended files.
+bench_layout()
+{
+    local i t
+
+    if ! command -v filefrag > /dev/null; then
+        skip "no filefrag"
+        return
+    fi
+    new_fs 1024
+    mkdir "$MNT/small" "$MNT/appended"
+    for i in $(seq 2000); do
+        head -c $(((i % 16 + 1) * 4))K /dev/urandom > "$MNT/small/$i" ||
+            fail "write small/$i"
+        head -c 64K /dev/urandom >> "$MNT/appended/$((i % 4))" ||
+            fail "append to appended/$((i % 4))"
+        if [ $((i % 50)) -eq 0 ]; then
+            sync
+        fi
+    done
+    rm "$MNT/small/"*[02468]
+    for i in 1 2 3 4; do
+        head -c 64M /dev/urandom > "$MNT/concurrent$i" &
+    done
+    wait
+    for i in 1 2 3 4; do
+        [ "$(stat -c %s "$MNT/concurrent$i")" = 67108864 ] ||
+            fail "write concurrent$i"
+    done
+    sync
+    report "extents per file, 4 x 31 MiB appended" \
+        "$(extents "$MNT/appended/"*)"
+    report "extents per file, 4 x 64 MiB written at once" \
+        "$(extents "$MNT/concurrent"*)"
+
+    remount
+    t=$(now)
+    cat "$MNT/appended/"* > /dev/null || fail "read appended files"
+    report "cold sequential read of the appended files" \
+        "$(rate $((4 * 500 * 64 * 1024)) "$(elapsed "$t")")"
+}
+
+# user-004: delayed allocation. A file deleted before writeback is never
+# allocated nor written, and a file written 4 KiB at a time gets a few large
+# extents at writeback.
+check_delalloc()
+{
+    local free sectors n
+
+    new_fs 1024
+    free=$(free_blocks)
+    dd if=/dev/zero of="$MNT/tmp" bs=4k count=4096 status=none ||
+        fail "write tmp"
+    [ "$(free_blocks)" -le $((free - 4096)) ] || fail "no space reserved"
+    sectors=$(dev_stat 7)
+    rm "$MNT/tmp"
+    sync
+    [ $(($(dev_stat 7) - sectors)) -lt 2048 ] ||
+        fail "a file deleted before writeback was written"
+    [ "$(free_blocks)" = "$free" ] || fail "a deleted delayed file leaked"
+
+    dd if=/dev/zero of="$MNT/stream" bs=4k count=16384 status=none ||
+        fail "write stream"
+    sync
+    if ! command -v filefrag > /dev/null; then
+        skip "no filefrag"
+        return
+    fi
+    n=$(extents "$MNT/stream")
+    report "extents of 64 MiB written 4 KiB at a time" "$n"
+    [ "${n%.*}" -le 4 ] || fail "$n extents for a streamed file"
+}
+
+# user-010: syncs under small-file churn. Each of 100 rounds creates 20 files
+# of 8 KiB, deletes 10 of them and syncs. Only the dirty bitmap blocks should
+# be written: rewriting both bitmaps of this 8 GiB image would take 512 KiB
+# per sync.
+bench_sync()
+{
+    local i j t sectors total=0
+
+    new_fs 8192
+    mkdir "$MNT/churn"
+    sync
+    sectors=$(dev_stat 7)
+    for i in $(seq 100); do
+        for j in $(seq 20); do
+            head -c 8K /dev/zero > "$MNT/churn/$i.$j" ||
+                fail "write churn/$i.$j"
+        done
+        rm "$MNT/churn/$i".1?
+        t=$(now)
+        sync
+        total=$(awk -v a="$total" -v b="$(elapsed "$t")" \
+                    'BEGIN { print a + b }')
+    done
+    report "sync latency" \
+        "$(awk -v t="$total" 'BEGIN { printf "%.1f ms", t * 10 }')"
+    report "written per sync" "$((($(dev_stat 7) - sectors) / 200)) KiB"
+}
+
+# user-011: inode writeback. The inodes of 10000 new empty files share 313
+# inode table blocks, which sync writes together instead of one request per
+# inode.
+check_inode_writeback()
+{
+    local writes
+
+    new_fs 1024
+    mkdir "$MNT/files"
+    sync
+    writes=$(dev_stat 5)
+    (cd "$MNT/files" && seq 10000 | xargs touch) || fail "create files"
+    sync
+    writes=$(($(dev_stat 5) - writes))
+    report "write requests to sync 10000 new inodes" "$writes"
+    [ "$writes" -lt 2000 ] || fail "inodes written one by one"
+}
+
+# user-011: create rate measured by fs_mark, without syncs
+bench_fs_mark()
+{
+    if ! command -v fs_mark > /dev/null; then
+        skip "no fs_mark"
+        return
+    fi
+    new_fs 1024
+    report "fs_mark, 4 x 10000 empty files" "$(
+        fs_mark -d "$MNT/fs_mark" -n 10000 -s 0 -S 0 -L 4 |
+            awk '$1 ~ /^[0-9]+$/ && NF == 5 { n++; r += $4 }
+                 END { printf "%.0f files/s", r / n }')"
+}
+
+# user-012: large directories. Creates, stats after a remount, and unlinks n
+# entries of a single directory for each n of DIR_SIZES. Indexed lookups and
+# insertions read at most 3 blocks, so the time per entry should stay flat.
+bench_dir()
+{
+    local n t
+
+    for n in ${DIR_SIZES:-1000 100000 1000000}; do
+        new_fs 8192
+        mkdir "$MNT/dir"
+        t=$(now)
+        (cd "$MNT/dir" && seq "$n" | xargs touch) || fail "create $n entries"
+        sync
+        report "create, $n entries" "$(per_entry "$(elapsed "$t")" "$n")"
+        [ "$(ls -f "$MNT/dir" | wc -l)" = $((n + 2)) ] ||
+            fail "readdir of $n entries"
+
+        remount
+        t=$(now)
+        (cd "$MNT/dir" && seq "$n" | xargs stat -c %i > /dev/null) ||
+            fail "stat $n entries"
+        report "cold stat, $n entries" "$(per_entry "$(elapsed "$t")" "$n")"
+
+        t=$(now)
+        (cd "$MNT/dir" && seq "$n" | xargs rm) || fail "unlink $n entries"
+        sync
+        report "unlink, $n entries" "$(per_entry "$(elapsed "$t")" "$n")"
+        [ -z "$(ls "$MNT/dir")" ] || fail "entries left"
+    done
+}
+
+# user-016: compiler-style header probing. 1000 headers are searched in turn
+# in 40 include directories of 200 headers each, most lookups missing. After a
+# remount, the first lookup of each directory builds its lookup cache, which
+# answers the others without reading any block.
+bench_probe()
+{
+    local d i name t lookups=0 found=0
+
+    new_fs 256
+    for d in {1..40}; do
+        mkdir "$MNT/inc$d" || fail "mkdir inc$d"
+        (cd "$MNT/inc$d" && seq -f "h$d.%g.h" 200 | xargs touch) ||
+            fail "create headers of inc$d"
+    done
+
+    remount
+    t=$(now)
+    for i in {1..1000}; do
+        name=h$((i % 40 + 1)).$((i % 200 + 1)).h
+        for d in {1..40}; do
+            lookups=$((lookups + 1))
+            if [ -e "$MNT/inc$d/$name" ]; then
+                found=$((found + 1))
+                break
+            fi
+        done
+    done
+    report "cold probes, $lookups lookups" \
+        "$(per_entry "$(elapsed "$t")" "$lookups")"
+    [ "$found" = 1000 ] || fail "found $found headers out of 1000"
+}
+
+# user-018: creates in distinct directories by 1 to 8 parallel jobs, up to
+# the number of CPUs, each creating 20000 files in its own directory. They
+# only meet in the allocation group locks, so the rate should scale with the
+# number of jobs.
+bench_parallel_create()
+{
+    local jobs j t
+
+    for jobs in 1 2 4 8; do
+        [ "$jobs" -le "$(nproc)" ] || break
+        new_fs 2048
+        for j in $(seq "$jobs"); do
+            mkdir "$MNT/dir$j" || fail "mkdir dir$j"
+        done
+        t=$(now)
+        for j in $(seq "$jobs"); do
+            (cd "$MNT/dir$j" && seq 20000 | xargs touch) &
+        done
+        wait
+        report "$jobs parallel jobs, 20000 creates each" "$(
+            awk -v n=$((jobs * 20000)) -v s="$(elapsed "$t")" \
+                'BEGIN { printf "%.0f files/s", n / s }')"
+        for j in $(seq "$jobs"); do
+            [ "$(ls "$MNT/dir$j" | wc -l)" = 20000 ] ||
+                fail "files missing in dir$j"
+        done
+    done
+}
+
+# user-019: cold sequential reads of a 256 MiB file, with the default
+# readahead, which maps whole extents and submits large bios, and with
+# readahead disabled, which reads a page at a time. Uses fio when installed,
+# dd otherwise.
+bench_readahead()
+{
+    local ra kb reads t
+
+    new_fs 1024
+    head -c 256M /dev/urandom > "$MNT/file" || fail "write file"
+    sync
+    ra=$(cat "/sys/block/$(dev_name)/queue/read_ahead_kb")
+    for kb in "$ra" 0; do
+        remount
+        echo "$kb" |
+            $SUDO tee "/sys/block/$(dev_name)/queue/read_ahead_kb" > /dev/null
+        reads=$(dev_stat 1)
+        if command -v fio > /dev/null; then
+            report "read_ahead_kb=$kb, fio" "$(fio_run read "$MNT/file" 256)"
+        else
+            t=$(now)
+            dd if="$MNT/file" of=/dev/null bs=1M status=none ||
+                fail "read file"
+            report "read_ahead_kb=$kb, dd" \
+                "$(rate $((256 << 20)) "$(elapsed "$t")")"
+        fi
+        report "read_ahead_kb=$kb, read requests" $(($(dev_stat 1) - reads))
+    done
+}
+
+# user-020: buffered sequential writes of 512 MiB, flushed by fsync.
+# Writeback maps whole extents and merges the dirty pages into large bios, so
+# write requests should be far larger than a page.
+bench_writeback()
+{
+    local t writes sectors
+
+    new_fs 1024
+    sync
+    writes=$(dev_stat 5)
+    sectors=$(dev_stat 7)
+    t=$(now)
+    dd if=/dev/zero of="$MNT/file" bs=1M count=512 conv=fsync status=none ||
+        fail "write file"
+    report "buffered sequential write" "$(rate $((512 << 20)) "$(elapsed "$t")")"
+    writes=$(($(dev_stat 5) - writes))
+    sectors=$(($(dev_stat 7) - sectors))
+    report "write requests" \
+        "$writes, $((sectors / 2 / writes)) KiB on average"
+}
+
+# user-021: direct I/O. Appending direct writes allocate blocks, overwrites
+# go in place, and the data read back directly or through the page cache
+# after a remount is the data written.
+check_direct()
+{
+    new_fs "$IMAGESIZE"
+    head -c 16M /dev/urandom > "$IMAGE.data"
+    dd if="$IMAGE.data" of="$MNT/file" bs=1M oflag=direct status=none ||
+        fail "direct append"
+    dd if=/dev/zero of="$IMAGE.data" bs=1M seek=4 count=2 conv=notrunc \
+        status=none
+    dd if=/dev/zero of="$MNT/file" bs=1M seek=4 count=2 conv=notrunc \
+        oflag=direct status=none || fail "direct overwrite"
+    dd if="$MNT/file" bs=1M iflag=direct status=none | cmp - "$IMAGE.data" ||
+        fail "direct read"
+    remount
+    cmp "$MNT/file" "$IMAGE.data" || fail "buffered read of direct writes"
+    rm -f "$IMAGE.data"
+}
+
+# user-021: fio sequential writes then reads of 512 MiB, direct and buffered,
+# with the rate and CPU use of each
+bench_direct()
+{
+    local direct
+
+    if ! command -v fio > /dev/null; then
+        skip "no fio"
+        return
+    fi
+    for direct in 1 0; do
+        new_fs 1024
+        report "write, direct=$direct" \
+            "$(fio_run write "$MNT/file" 512 --direct=$direct --end_fsync=1)"
+        report "read, direct=$direct" \
+            "$(fio_run read "$MNT/file" 512 --direct=$direct --invalidate=1)"
+    done
+}
+
+# Print the logical start, in blocks, and the flags of each extent of file $1
+# reported by filefrag -v
+fiemap_extents()
+{
+    filefrag -v "$1" |
+        awk '$1 ~ /^[0-9]+:$/ { sub(/\.+$/, "", $2); print $2, $NF }'
+}
+
+# user-024: FIEMAP, as seen by filefrag -v: inline data, unwritten
+# preallocated extents, delayed extents not written back yet, and the holes
+# of a sparse file
+check_fiemap()
+{
+    if ! command -v filefrag > /dev/null; then
+        skip "no filefrag"
+        return
+    fi
+    new_fs "$IMAGESIZE"
+    echo hello > "$MNT/inline" || fail "write inline"
+    fallocate -l 1M "$MNT/prealloc" || fail "fallocate"
+    dd if=/dev/zero of="$MNT/sparse" bs=4k count=1 status=none ||
+        fail "write sparse"
+    dd if=/dev/zero of="$MNT/sparse" bs=4k seek=256 count=1 conv=notrunc \
+        status=none || fail "write sparse"
+    sync
+    head -c 64K /dev/zero > "$MNT/delayed" || fail "write delayed"
+
+    fiemap_extents "$MNT/inline" | grep -q 'inline' ||
+        fail "inline data not reported"
+    fiemap_extents "$MNT/prealloc" | grep -q 'unwritten' ||
+        fail "preallocated extent not unwritten"
+    fiemap_extents "$MNT/delayed" | grep -q 'delalloc' ||
+        fail "delayed extent not reported"
+    [ "$(fiemap_extents "$MNT/sparse" | awk '{ print $1 }' | xargs)" = \
+        "0 256" ] || fail "sparse file extents: $(fiemap_extents "$MNT/sparse")"
+    [ "$(fiemap_extents "$MNT/sparse" | grep -c 'unwritten\|delalloc')" = 0 ] ||
+        fail "sparse file extents not written"
+}
+
+# Copy file $1 to $2 with sendfile(), through the splice paths of both files
+sendfile_copy()
+{
+    python3 -c '
+import os, sys
+src = os.open(sys.argv[1], os.O_RDONLY)
+dst = os.open(sys.argv[2], os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+size, off = os.fstat(src).st_size, 0
+while off < size:
+    off += os.sendfile(dst, src, off, size - off)
+' "$1" "$2"
+}
+
+# user-025: sendfile() from and to myfs files, which go through splice_read
+# and splice_write
+check_splice()
+{
+    if ! command -v python3 > /dev/null; then
+        skip "no python3"
+        return
+    fi
+    new_fs "$IMAGESIZE"
+    head -c 8M /dev/urandom > "$IMAGE.data"
+    sendfile_copy "$IMAGE.data" "$MNT/file" || fail "sendfile to myfs"
+    sendfile_copy "$MNT/file" "$IMAGE.copy" || fail "sendfile from myfs"
+    cmp "$IMAGE.data" "$IMAGE.copy" || fail "sendfile from myfs"
+    remount
+    cmp "$IMAGE.data" "$MNT/file" || fail "sendfile to myfs"
+    rm -f "$IMAGE.data" "$IMAGE.copy"
+}
+
+# user-025: a 256 MiB file sent 8 times to a loopback TCP socket by sendfile(),
+# which splices the page cache to the socket, and by a read() and send() loop
+bench_sendfile()
+{
+    local mode r
+
+    if ! command -v python3 > /dev/null; then
+        skip "no python3"
+        return
+    fi
+    new_fs 1024
+    head -c 256M /dev/urandom > "$MNT/file" || fail "write file"
+    for mode in sendfile copy; do
+        r=$(script/sendfile.py "$MNT/file" 8 $mode) || fail "$mode"
+        report "$mode to a loopback socket" "$r"
+    done
+}
+
+CHECKS="check_smoke check_delalloc check_inode_writeback check_direct
+        check_splice check_fiemap"
+BENCHES="bench_alloc bench_layout bench_sync bench_fs_mark bench_dir bench_probe
+         bench_parallel_create bench_readahead bench_writeback bench_direct
+         bench_sendfile"
+
+[ -f simplefs.ko ] || fail "simplefs.ko is not built"
+[ -x "$MKFS" ] || fail "$MKFS is not built"
+LOADED=
+if ! grep -q '^simplefs ' /proc/modules; then
+    $SUDO insmod simplefs.ko || fail "insmod simplefs.ko"
+    LOADED=1
+fi
+mkdir -p "$MNT"
+trap cleanup EXIT
+
+[ "$BENCH" = 0 ] && BENCHES=
+for t in $CHECKS $BENCHES; do
+    echo "$t"
+    $t
+done
+echo "All checks passed"
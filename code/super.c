@@ -1,9 +1,11 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/parser.h>
 #include <linux/slab.h>
 #include <linux/statfs.h>
 
@@ -33,15 +35,38 @@ static struct inode *myfs_alloc_inode(struct super_block *sb)
         return NULL;
 
     inode_init_once(&ci->vfs_inode);
+    spin_lock_init(&ci->i_reserve_lock);
+    ci->i_reserved = 0;
+    init_rwsem(&ci->i_map_sem);
+    ci->i_extents = NULL;
+    ci->i_nr_extents = 0;
+    ci->i_max_extents = 0;
+    ci->i_extents_valid = false;
+    ci->i_map_seq = 0;
+    ci->i_delayed = RB_ROOT;
+    spin_lock_init(&ci->i_ioend_lock);
+    INIT_LIST_HEAD(&ci->i_ioend_list);
+    INIT_WORK(&ci->i_ioend_work, myfs_end_io);
+    init_rwsem(&ci->i_dir_sem);
+    seqlock_init(&ci->i_dir_seqlock);
+    RCU_INIT_POINTER(ci->i_dir_cache, NULL);
     return &ci->vfs_inode;
 }
 
 static void myfs_destroy_inode(struct inode *inode)
 {
     struct myfs_inode_info *ci = MYFS_INODE(inode);
+    kfree(ci->i_extents);
+    myfs_da_remove(inode, 0, U32_MAX);
+    myfs_dir_cache_drop(inode);
     kmem_cache_free(myfs_inode_cache, ci);
 }
 
+/*
+ * Copy inode to its slot of the inode store. The block is only marked dirty:
+ * all the inodes sharing it are written at once by the block device
+ * writeback. Only data integrity writeback (sync, fsync) waits for the write.
+ */
 static int myfs_write_inode(struct inode *inode,
                                 struct writeback_control *wbc)
 {
@@ -53,6 +78,7 @@ static int myfs_write_inode(struct inode *inode,
     uint32_t ino = inode->i_ino;
     uint32_t inode_block = (ino / MYFS_INODES_PER_BLOCK) + 1;
     uint32_t inode_shift = ino % MYFS_INODES_PER_BLOCK;
+    int ret = 0;
 
     if (ino >= sbi->nr_inodes)
         return 0;
@@ -68,37 +94,95 @@ static int myfs_write_inode(struct inode *inode,
     disk_inode->i_mode = inode->i_mode;
     disk_inode->i_uid = i_uid_read(inode);
     disk_inode->i_gid = i_gid_read(inode);
-    disk_inode->i_size = inode->i_size;
+    disk_inode->i_size = (uint32_t) inode->i_size;
+    disk_inode->i_size_high = (uint32_t) (inode->i_size >> 32);
     disk_inode->i_ctime = inode->i_ctime.tv_sec;
     disk_inode->i_atime = inode->i_atime.tv_sec;
     disk_inode->i_mtime = inode->i_mtime.tv_sec;
     disk_inode->i_blocks = inode->i_blocks;
     disk_inode->i_nlink = inode->i_nlink;
     disk_inode->ei_block = ci->ei_block;
-    strncpy(disk_inode->i_data, ci->i_data, sizeof(ci->i_data));
+    disk_inode->i_flags = ci->i_flags;
+    memcpy(disk_inode->i_data, ci->i_data, sizeof(ci->i_data));
 
     mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    if (wbc->sync_mode == WB_SYNC_ALL) {
+        sync_dirty_buffer(bh);
+        if (buffer_write_io_error(bh))
+            ret = -EIO;
+    }
     brelse(bh);
 
-    return 0;
+    return ret;
 }
 
 static void myfs_put_super(struct super_block *sb)
 {
     struct myfs_sb_info *sbi = MYFS_SB(sb);
     if (sbi) {
+        destroy_workqueue(sbi->unwritten_wq);
+        myfs_groups_destroy(sbi);
         kfree(sbi->ifree_bitmap);
         kfree(sbi->bfree_bitmap);
         kfree(sbi);
     }
 }
 
+/*
+ * Copy the bitmap blocks of the dirty groups among the nr first of groups to
+ * the buffer cache, the i-th one being block first + i. With wait, also start
+ * writing them.
+ */
+static int myfs_sync_bitmap(struct super_block *sb,
+                            struct myfs_group *groups,
+                            uint32_t nr,
+                            uint32_t first,
+                            unsigned long *bitmap,
+                            int wait)
+{
+    struct buffer_head *bh;
+    uint32_t i;
+
+    for (i = 0; i < nr; i++) {
+        struct myfs_group *g = &groups[i];
+
+        if (!READ_ONCE(g->dirty))
+            continue;
+
+        /* The whole block is overwritten, no need to read it */
+        bh = sb_getblk(sb, first + i);
+        if (!bh)
+            return -EIO;
+
+        lock_buffer(bh);
+        spin_lock(&g->lock);
+        memcpy(bh->b_data, (void *) bitmap + i * MYFS_BLOCK_SIZE,
+               MYFS_BLOCK_SIZE);
+        g->dirty = false;
+        spin_unlock(&g->lock);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+
+        mark_buffer_dirty(bh);
+        if (wait)
+            write_dirty_buffer(bh, 0);
+        brelse(bh);
+    }
+
+    return 0;
+}
+
+/*
+ * Write the superblock and the bitmap blocks which changed since the last
+ * sync. With wait, the writes are all submitted at once under a plug; the
+ * block device sync that follows in sync_filesystem() waits for them.
+ */
 static int myfs_sync_fs(struct super_block *sb, int wait)
 {
     struct myfs_sb_info *sbi = MYFS_SB(sb);
     struct myfs_sb_info *disk_sb;
-    int i;
+    struct blk_plug plug;
+    int ret;
 
     /* Flush superblock */
     struct buffer_head *bh = sb_bread(sb, 0);
@@ -112,49 +196,30 @@ static int myfs_sync_fs(struct super_block *sb, int wait)
     disk_sb->nr_istore_blocks = sbi->nr_istore_blocks;
     disk_sb->nr_ifree_blocks = sbi->nr_ifree_blocks;
     disk_sb->nr_bfree_blocks = sbi->nr_bfree_blocks;
-    disk_sb->nr_free_inodes = sbi->nr_free_inodes;
-    disk_sb->nr_free_blocks = sbi->nr_free_blocks;
+    disk_sb->nr_free_inodes =
+        percpu_counter_sum_positive(&sbi->free_inodes_counter);
+    disk_sb->nr_free_blocks =
+        percpu_counter_sum_positive(&sbi->free_blocks_counter);
+
+    blk_start_plug(&plug);
 
     mark_buffer_dirty(bh);
     if (wait)
-        sync_dirty_buffer(bh);
+        write_dirty_buffer(bh, 0);
     brelse(bh);
 
-    /* Flush free inodes bitmask */
-    for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-        int idx = sbi->nr_istore_blocks + i + 1;
+    /* Flush free inodes and free blocks bitmasks, one group per block */
+    ret = myfs_sync_bitmap(sb, sbi->igroups, sbi->nr_ifree_blocks,
+                           sbi->nr_istore_blocks + 1, sbi->ifree_bitmap, wait);
+    if (!ret)
+        ret = myfs_sync_bitmap(
+            sb, sbi->bgroups, sbi->nr_bfree_blocks,
+            sbi->nr_istore_blocks + sbi->nr_ifree_blocks + 1,
+            sbi->bfree_bitmap, wait);
 
-        bh = sb_bread(sb, idx);
-        if (!bh)
-            return -EIO;
+    blk_finish_plug(&plug);
 
-        memcpy(bh->b_data, (void *) sbi->ifree_bitmap + i * MYFS_BLOCK_SIZE,
-               MYFS_BLOCK_SIZE);
-
-        mark_buffer_dirty(bh);
-        if (wait)
-            sync_dirty_buffer(bh);
-        brelse(bh);
-    }
-
-    /* Flush free blocks bitmask */
-    for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-        int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
-
-        bh = sb_bread(sb, idx);
-        if (!bh)
-            return -EIO;
-
-        memcpy(bh->b_data, (void *) sbi->bfree_bitmap + i * MYFS_BLOCK_SIZE,
-               MYFS_BLOCK_SIZE);
-
-        mark_buffer_dirty(bh);
-        if (wait)
-            sync_dirty_buffer(bh);
-        brelse(bh);
-    }
-
-    return 0;
+    return ret;
 }
 
 static int myfs_statfs(struct dentry *dentry, struct kstatfs *stat)
@@ -165,15 +230,76 @@ static int myfs_statfs(struct dentry *dentry, struct kstatfs *stat)
     stat->f_type = MYFS_MAGIC;
     stat->f_bsize = MYFS_BLOCK_SIZE;
     stat->f_blocks = sbi->nr_blocks;
-    stat->f_bfree = sbi->nr_free_blocks;
-    stat->f_bavail = sbi->nr_free_blocks;
-    stat->f_files = sbi->nr_inodes - sbi->nr_free_inodes;
-    stat->f_ffree = sbi->nr_free_inodes;
+    /* Blocks reserved by delayed allocation are not available anymore */
+    stat->f_bfree =
+        max_t(s64, 0,
+              percpu_counter_sum_positive(&sbi->free_blocks_counter) -
+                  percpu_counter_sum_positive(&sbi->dirty_blocks_counter));
+    stat->f_bavail = stat->f_bfree;
+    stat->f_ffree = percpu_counter_sum_positive(&sbi->free_inodes_counter);
+    stat->f_files = sbi->nr_inodes - stat->f_ffree;
     stat->f_namelen = MYFS_FILENAME_LEN;
 
     return 0;
 }
 
+/*
+ * Mount options. Access times are updated by the VFS when files are read or
+ * directories listed, never by lookups, following the noatime, relatime
+ * (default) or strictatime flags of the mount, which the VFS handles itself.
+ * lazytime keeps time updates in memory until the inode is written for
+ * another reason, synced, or up to a day later; mount(8) passes it as a
+ * flag, it is only parsed here when it reaches the option string. Unknown
+ * options are logged and ignored, as they always were.
+ */
+enum { Opt_lazytime, Opt_nolazytime, Opt_err };
+
+static const match_table_t myfs_tokens = {
+    {Opt_lazytime, "lazytime"},
+    {Opt_nolazytime, "nolazytime"},
+    {Opt_err, NULL},
+};
+
+/* Parse the mount options in data into the SB_* flags */
+static void myfs_parse_options(char *data, unsigned long *flags)
+{
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+
+    if (!data)
+        return;
+
+    while ((p = strsep(&data, ",")) != NULL) {
+        if (!*p)
+            continue;
+
+        switch (match_token(p, myfs_tokens, args)) {
+        case Opt_lazytime:
+            *flags |= SB_LAZYTIME;
+            break;
+        case Opt_nolazytime:
+            *flags &= ~SB_LAZYTIME;
+            break;
+        default:
+            pr_warn("ignoring unknown mount option \"%s\"\n", p);
+            break;
+        }
+    }
+}
+
+static int myfs_remount_fs(struct super_block *sb, int *flags, char *data)
+{
+    unsigned long sb_flags = *flags;
+
+    sync_filesystem(sb);
+
+    /* The VFS applies SB_LAZYTIME from flags */
+    myfs_parse_options(data, &sb_flags);
+    *flags = (*flags & ~SB_LAZYTIME) | (sb_flags & SB_LAZYTIME);
+
+    return 0;
+}
+
 static struct super_operations myfs_super_ops = {
     .put_super = myfs_put_super,
     .alloc_inode = myfs_alloc_inode,
@@ -181,6 +307,7 @@ static struct super_operations myfs_super_ops = {
     .write_inode = myfs_write_inode,
     .sync_fs = myfs_sync_fs,
     .statfs = myfs_statfs,
+    .remount_fs = myfs_remount_fs,
 };
 
 /* Fill the struct superblock from partition superblock */
@@ -198,6 +325,8 @@ int myfs_fill_super(struct super_block *sb, void *data, int silent)
     sb->s_maxbytes = MYFS_MAX_FILESIZE;
     sb->s_op = &myfs_super_ops;
 
+    myfs_parse_options(data, &sb->s_flags);
+
     /* Read sb from disk */
     bh = sb_bread(sb, MYFS_SB_BLOCK_NR);
     if (!bh)
@@ -226,6 +355,13 @@ int myfs_fill_super(struct super_block *sb, void *data, int silent)
     sbi->nr_bfree_blocks = csb->nr_bfree_blocks;
     sbi->nr_free_inodes = csb->nr_free_inodes;
     sbi->nr_free_blocks = csb->nr_free_blocks;
+    memcpy(sbi->hash_seed, csb->hash_seed, sizeof(sbi->hash_seed));
+    if (!(sbi->hash_seed[0] | sbi->hash_seed[1] | sbi->hash_seed[2] |
+          sbi->hash_seed[3])) {
+        pr_err("No directory hash key, the filesystem needs a new mkfs\n");
+        ret = -EINVAL;
+        goto free_sbi;
+    }
     sb->s_fs_info = sbi;
 
     brelse(bh);
@@ -276,11 +412,25 @@ int myfs_fill_super(struct super_block *sb, void *data, int silent)
         brelse(bh);
     }
 
+    /* Split the bitmaps in allocation groups */
+    ret = myfs_groups_init(sbi);
+    if (ret)
+        goto free_bfree;
+
+    /* Writeback completion may allocate, it must progress under reclaim */
+    sbi->unwritten_wq = alloc_workqueue("myfs-unwritten/%s",
+                                        WQ_MEM_RECLAIM | WQ_FREEZABLE, 0,
+                                        sb->s_id);
+    if (!sbi->unwritten_wq) {
+        ret = -ENOMEM;
+        goto free_groups;
+    }
+
     /* Create root inode */
     root_inode = myfs_iget(sb, 0);
     if (IS_ERR(root_inode)) {
         ret = PTR_ERR(root_inode);
-        goto free_bfree;
+        goto destroy_wq;
     }
     inode_init_owner(root_inode, NULL, root_inode->i_mode);
     sb->s_root = d_make_root(root_inode);
@@ -293,6 +443,10 @@ int myfs_fill_super(struct super_block *sb, void *data, int silent)
 
 iput:
     iput(root_inode);
+destroy_wq:
+    destroy_workqueue(sbi->unwritten_wq);
+free_groups:
+    myfs_groups_destroy(sbi);
 free_bfree:
     kfree(sbi->bfree_bitmap);
 free_ifree: